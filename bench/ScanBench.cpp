@@ -0,0 +1,153 @@
+// Compares the vectorized track scanning against the byte by byte scan on
+// dense controller data, then sweeping the tempo map against searching it
+// Build and run with `make bench`
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "MidiFile.hpp"
+#include "MidiScan.hpp"
+#include "MidiStatus.hpp"
+
+// Defined in MidiFile.cpp, not part of the interface
+v_len readVarLen(const u8*& data, const u8* end);
+
+// The pre-scan exactly as it was before the vectorized kernel, meta and sysex
+// events included, so both sides pay for the same checks
+enum MidiError scalarCountMidiMessages(const u8* data, const u8* end,
+                                       u32& count) {
+    u8 running = 0;
+    v_len length;
+    count = 0;
+    while (data < end) {
+        if (readVarLen(data, end) == (v_len)-1) return V_LEN_INVALID;
+        if (data >= end) return INVALID_EVENT;
+
+        const u8 b = *data;
+        if (b < 0x80) {
+            // Running status, data is already on the first data byte
+            if (running == 0) return INVALID_EVENT;
+            data += STATUS_TABLE[running].length;
+        } else if (b < SYSEX) {
+            running = b;
+            data += 1 + STATUS_TABLE[b].length;
+        } else if ((b == 0xFF && data + 1 < end && data[1] < 0x80) ||
+                   b == SYSEX || b == SYSEX_END) {
+            data += b == 0xFF ? 2 : 1;
+            length = readVarLen(data, end);
+            if (length == (v_len)-1) return V_LEN_INVALID;
+            if (length > (std::size_t)(end - data)) return INVALID_EVENT;
+            data += length;
+        } else {
+            data += 1 + STATUS_TABLE[b].length;
+        }
+        if (data > end) return INVALID_EVENT;
+        count++;
+    }
+    return NONE;
+}
+
+// CC and pitch wheel curves with running status, mostly one byte deltas
+std::vector<u8> makeControllerTrack(std::size_t events) {
+    std::mt19937 rng(42);
+    std::vector<u8> res;
+    res.reserve(events * 3);
+    u8 running = 0;
+    for (std::size_t i = 0; i < events; i++) {
+        if (rng() % 64 == 0) {
+            // long delta
+            res.push_back(0x81);
+            res.push_back(rng() % 0x80);
+        } else {
+            res.push_back(rng() % 8);
+        }
+        u8 status = (rng() % 256 == 0) ? 0xE0 : 0xB0;
+        if (status != running) res.push_back(status);
+        running = status;
+        res.push_back(rng() % 0x80);
+        res.push_back(rng() % 0x80);
+    }
+    return res;
+}
+
+template <typename F>
+double measure(F f, int runs = 10) {
+    double best = 1e300;
+    for (int i = 0; i < runs; i++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double, std::milli> d =
+            std::chrono::steady_clock::now() - start;
+        if (d.count() < best) best = d.count();
+    }
+    return best;
+}
+
+int main() {
+    constexpr std::size_t EVENTS = 20000000;
+    std::vector<u8> track = makeControllerTrack(EVENTS);
+    const u8* begin = track.data();
+    const u8* end = begin + track.size();
+    const double mb = track.size() / 1e6;
+
+    std::cout << "Track of " << EVENTS << " events, " << mb << " MB\n";
+
+    std::size_t sink = 0;
+    double scalar = measure([&]() {
+        for (const u8* p = begin; p < end; p++)
+            p += countDataBytesScalar(p, end), sink++;
+    });
+    double simd = measure([&]() {
+        for (const u8* p = begin; p < end; p++)
+            p += countDataBytes(p, end), sink++;
+    });
+    std::cout << "data byte runs   scalar " << scalar << " ms ("
+              << mb / scalar * 1000 << " MB/s)   vectorized " << simd
+              << " ms (" << mb / simd * 1000 << " MB/s)\n";
+
+    u32 a = 0, b = 0;
+    scalar = measure([&]() { scalarCountMidiMessages(begin, end, a); });
+    simd = measure([&]() { countMidiMessages(begin, end, b); });
+    std::cout << "pre-scan         scalar " << scalar << " ms ("
+              << mb / scalar * 1000 << " MB/s)   vectorized " << simd
+              << " ms (" << mb / simd * 1000 << " MB/s)\n";
+    if (a != EVENTS || b != EVENTS) {
+        std::cerr << "Event count mismatch " << a << " " << b << "\n";
+        return 1;
+    }
+
+    struct MidiTrack t;
+    t.data = begin;
+    t.length = track.size();
+    double decode = measure([&]() { decodeTrack(t); }, 3);
+    std::cout << "full decode      " << decode << " ms ("
+              << mb / decode * 1000 << " MB/s)\n";
+
+    // Tick to time of every event, through a map of a few thousand tempos
+    std::vector<v_len> ticks(t.list.size());
+    for (std::size_t i = 0; i < ticks.size(); i++) ticks[i] = t.list.time(i);
+    std::vector<TempoChange> tempos;
+    std::mt19937 rng(7);
+    for (v_len time = 0; time < ticks.back(); time += 1 + rng() % 8192) {
+        tempos.push_back(TempoChange{
+            .time = time,
+            .timeMicros = tempos.empty()
+                              ? 0
+                              : getTimeMicros(tempos.back(), time),
+            .microsPerTick = getMicrosPerTick(480, 300000 + rng() % 400000)});
+    }
+    std::vector<u64> micros(ticks.size());
+    double search = measure([&]() {
+        for (std::size_t i = 0; i < ticks.size(); i++)
+            micros[i] = getTimeMicros(tempos, ticks[i]);
+    }, 3);
+    double sweep = measure([&]() {
+        getTimesMicros(tempos, ticks.data(), ticks.size(), micros.data());
+    }, 3);
+    std::cout << "tick to micros   search " << search << " ms   sweep " << sweep
+              << " ms (" << tempos.size() << " tempos)\n";
+    return sink == 0;
+}
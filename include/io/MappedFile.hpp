@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "Ints.hpp"
+
+// Read only memory mapping of a whole file
+// The mapped bytes stay valid until the object is destroyed
+class MappedFile {
+   public:
+    MappedFile() {}
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns false if the file could not be opened or mapped
+    bool open(const std::string& path);
+    void close();
+
+    inline const u8* data() const { return ptr; }
+    inline std::size_t size() const { return length; }
+
+    ~MappedFile() { close(); }
+
+   private:
+    const u8* ptr = nullptr;
+    std::size_t length = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
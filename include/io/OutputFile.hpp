@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Ints.hpp"
+
+struct OutputChunk {
+    const u8* data;
+    std::size_t size;
+};
+
+// Write only file, truncated when opened
+class OutputFile {
+   public:
+    OutputFile() {}
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    // Returns false if the file could not be created
+    bool open(const std::string& path);
+    // Same but fails if the file already exists
+    bool create(const std::string& path);
+    // Gives the file the permissions of the one at path, if there is one
+    bool copyModeOf(const std::string& path);
+    // Returns false if anything written before could not be flushed
+    bool close();
+
+    // Writes the chunks one after the other, with a single writev call when
+    // the system allows it
+    bool write(const std::vector<struct OutputChunk>& chunks);
+
+    // Allocates the blocks of a file that will be size bytes long so that
+    // running out of space fails here rather than in the middle of a write
+    // Succeeds without doing anything where the file system can not do it
+    bool reserve(u64 size);
+    // Returns once everything written so far is on disk
+    bool sync();
+
+    inline bool isOpen() const {
+#ifdef _WIN32
+        return file != nullptr;
+#else
+        return fd >= 0;
+#endif
+    }
+
+    ~OutputFile() { close(); }
+
+   private:
+#ifdef _WIN32
+    void* file = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+// Writes to a temporary file next to the target and only replaces the target
+// once everything was written and synced, so that a failed or interrupted
+// save never leaves a partial file behind
+// The temporary file gets a name no other file has, and the permissions of
+// the target it replaces
+class AtomicFile {
+   public:
+    AtomicFile() {}
+
+    AtomicFile(const AtomicFile&) = delete;
+    AtomicFile& operator=(const AtomicFile&) = delete;
+
+    // Returns false if the temporary file could not be created
+    bool open(const std::string& path);
+    inline OutputFile& output() { return file; }
+    inline const std::string& tempPath() const { return tmpPath; }
+
+    // Syncs the temporary file then renames it over the target
+    // The temporary file is removed if anything fails
+    bool commit();
+    // Removes the temporary file, the target is left untouched
+    void discard();
+
+    ~AtomicFile() { discard(); }
+
+   private:
+    OutputFile file;
+    std::string path;
+    std::string tmpPath;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "MidiFile.hpp"
+
+// Undo and redo of the edits made to the events of a file
+// A step only keeps the chunks of the tracks it touched that differ from the
+// version after it, everything else is shared with the file, so a step costs
+// about what it changed in memory
+// Time is another matter: record() copies the list of chunks of the track and
+// commit() compares it with the edited one, so both take time linear in the
+// size of the track, at one pointer per CHUNK_EVENTS events, as does the
+// snapshot of the track published to the render thread afterwards
+// Tracks must not be added, removed or moved while steps are kept, clear()
+// the history when they are
+class EditHistory {
+   public:
+    static constexpr std::size_t DEFAULT_BUDGET = 256 << 20;
+
+    EditHistory(std::size_t budget = DEFAULT_BUDGET) : budget(budget) {}
+
+    // Once the history holds more than that many bytes, the steps furthest
+    // from the current version are dropped, the last one that can be undone
+    // is always kept
+    void setBudget(std::size_t bytes);
+    inline std::size_t getBudget() const { return budget; }
+    inline std::size_t bytesUsed() const { return used; }
+
+    // Steps group every edit made until commit(), which only records the
+    // step if a track was recorded
+    void begin();
+    // Before the first edit of a decoded track in the step
+    void record(const struct MidiFile &file, u16 track);
+    // Drops everything that could be redone
+    void commit(const struct MidiFile &file);
+
+    inline bool canUndo() const { return !undoSteps.empty(); }
+    inline bool canRedo() const { return !redoSteps.empty(); }
+    // Puts the tracks of the last step back, tracks receives them in
+    // increasing order so the time maps can be updated
+    bool undo(struct MidiFile &file, std::vector<u16> &tracks);
+    bool redo(struct MidiFile &file, std::vector<u16> &tracks);
+
+    void clear();
+
+   private:
+    struct Step {
+        std::vector<std::pair<u16, EventStore::Version>> tracks;
+        std::size_t bytes = 0;
+    };
+
+    std::deque<struct Step> undoSteps, redoSteps;
+    // Tracks of the open step as they were before it
+    std::vector<std::pair<u16, EventStore>> before;
+    bool open = false;
+
+    std::size_t budget;
+    std::size_t used = 0;
+
+    // Restores the step and turns it into the one going the other way
+    static void swap(struct MidiFile &file, struct Step &step,
+                     std::vector<u16> &tracks);
+    void trim();
+};
@@ -1,11 +1,21 @@
 #ifndef MIDIFILE_H
 #define MIDIFILE_H
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdbool>
 #include <cstring>
+#include <memory>
+#include <stdexcept>
 #include <vector>
 
+#include "Arena.hpp"
 #include "Ints.hpp"
+#include "MappedFile.hpp"
+
+class OutputFile;
+class ThreadPool;
 
 // Variable length quantity (encoded values between 8 and 28 bits)
 typedef u32 v_len;
@@ -79,7 +89,8 @@ enum MidiError {
     INVALID_HEADER,
     INVALID_TRACK,
     NOT_ENOUGH_MEMORY,
-    INVALID_EVENT
+    INVALID_EVENT,
+    WRITE_FAILED
 };
 #pragma endregion
 
@@ -248,14 +259,16 @@ struct SysExEvent {
     u8 *data = nullptr;
     // + 1 length for the null char
 
+    u8 type = SYSEX;  // or SYSEX_END for escape sequences
+
     SysExEvent() {}
     SysExEvent(u8 *data, v_len len) : length(len), data(data) {}
     SysExEvent(v_len len) : length(len), data(new u8[len + 1]) {}
     SysExEvent(const SysExEvent &cpy)
-        : length(cpy.length), data(new u8[cpy.length + 1]) {
+        : length(cpy.length), data(new u8[cpy.length + 1]), type(cpy.type) {
         if (length > 0) std::memcpy(data, cpy.data, cpy.length + 1);
     }
-    SysExEvent(SysExEvent &&mov) : length(mov.length) {
+    SysExEvent(SysExEvent &&mov) : length(mov.length), type(mov.type) {
         std::swap(mov.data, this->data);
     }
 
@@ -363,41 +376,339 @@ struct TrackEvent {
     }
 };
 
+// Events of a track stored column by column, so that passes over ticks or
+// types only pull the bytes they look at through the cache
+// The columns are cut in chunks of at most CHUNK_EVENTS events, with a
+// Fenwick tree over the event count and tick span of every chunk, so that
+// inserting, erasing and finding event i or a tick are all logarithmic
+// Copies share their chunks, which are only copied once either side edits
+// them
+class EventStore {
+    struct Chunk;
+
+   public:
+    EventStore() {}
+    EventStore(const EventStore &cpy);
+    EventStore &operator=(const EventStore &cpy);
+    EventStore(EventStore &&mov);
+    EventStore &operator=(EventStore &&mov);
+
+    inline std::size_t size() const { return events; }
+    inline bool empty() const { return events == 0; }
+    void reserve(std::size_t n);
+    void clear();
+
+    inline v_len deltaTime(std::size_t i) const {
+        std::size_t k;
+        return chunkAt(i, k).deltas[k];
+    }
+    // Absolute tick, always up to date with the deltas
+    inline v_len time(std::size_t i) const {
+        std::size_t k;
+        const Chunk &chunk = chunkAt(i, k);
+        return origin + cacheTick + chunk.ticks[k];
+    }
+    // Status byte as written in the file, 0xFF for meta events
+    inline u8 status(std::size_t i) const {
+        std::size_t k;
+        return chunkAt(i, k).statuses[k];
+    }
+    // Meta type for meta events
+    inline u8 data0(std::size_t i) const {
+        std::size_t k;
+        return chunkAt(i, k).data0s[k];
+    }
+    // For meta and sysex events, 0x80 | length when the payload is inline
+    inline u8 data1(std::size_t i) const {
+        std::size_t k;
+        return chunkAt(i, k).data1s[k];
+    }
+
+    enum TrackEventType type(std::size_t i) const;
+    inline bool isMeta(std::size_t i, u8 metaType) const {
+        std::size_t k;
+        const Chunk &chunk = chunkAt(i, k);
+        return chunk.statuses[k] == 0xFF && chunk.data0s[k] == metaType;
+    }
+
+    // Raw bytes of meta and sysex events, after the length
+    // Inline payloads point into the chunk, so only until the next insertion
+    // or erasure
+    // Not null terminated when viewing the source file
+    inline const u8 *payloadData(std::size_t i) const {
+        std::size_t k;
+        const Chunk &chunk = chunkAt(i, k);
+        if (chunk.isInline(k)) return chunk.payloads[k].bytes;
+        const u8 *data = chunk.payloads[k].data;
+        while (*data++ & 0x80);
+        return data;
+    }
+    inline v_len payloadLength(std::size_t i) const {
+        std::size_t k;
+        const Chunk &chunk = chunkAt(i, k);
+        if (chunk.isInline(k)) return chunk.data1s[k] & 0x7F;
+        const u8 *data = chunk.payloads[k].data;
+        v_len length = *data & 0x7F;
+        while (*data++ & 0x80) length = (length << 7) | (*data & 0x7F);
+        return length;
+    }
+
+    // First event at or after the tick, size() if none
+    std::size_t findTime(v_len tick) const;
+
+    // Conversions from and to a standalone event
+    struct TrackEvent get(std::size_t i) const;
+    void set(std::size_t i, const struct TrackEvent &e);
+    void insert(std::size_t i, const struct TrackEvent &e);
+    void push_back(const struct TrackEvent &e);
+    void erase(std::size_t i);
+
+    // Later ticks follow
+    void setDeltaTime(std::size_t i, v_len delta);
+
+    // Whether events were changed since the last clear(), appending with
+    // pushMessage() and pushPayload() does not count
+    inline bool isEdited() const { return edited; }
+
+    // Appends without building a TrackEvent, used by the decoder
+    // Only the time of the first event is used, as the tick the deltas start
+    // from, the others follow the deltas
+    void pushMessage(v_len delta, v_len time, u8 status, u8 data0, u8 data1);
+    // The event views its payload, record points at its length and must stay
+    // valid as long as the store (the source mapping of the document)
+    // Short payloads are still copied inline
+    void pushPayload(v_len delta, v_len time, u8 status, u8 data0,
+                     const u8 *record, v_len length);
+
+    // Changes every time the ticks or the number of events may have changed
+    // Unique across stores, so a store put back to an older version gets the
+    // generation it had then
+    inline u32 timesGeneration() const { return generation; }
+
+    // Chunks of an older version of a store that differ from a newer one,
+    // enough to turn the newer one back into it
+    struct Version {
+        // Chunks both versions share at the start and at the end
+        std::size_t prefix = 0, suffix = 0;
+        std::vector<std::shared_ptr<Chunk>> chunks;
+        std::size_t events = 0;
+        v_len origin = 0;
+        bool edited = false;
+        u32 generation = 0;
+
+        // Memory the version holds on its own
+        std::size_t bytes() const;
+    };
+    // What older, a copy of this store made before editing it, has that this
+    // store no longer shares
+    struct Version versionOf(const EventStore &older) const;
+    // Makes the store the version again, which then holds what is needed to
+    // come back to the store as it was
+    void restore(struct Version &version);
+
+    // Payloads are allocated from the arena of the document owning the track
+    inline void setArena(Arena *arena) { allocator = ArenaAllocator(arena); }
+
+    // A few pages per chunk, splitting one only moves half of that
+    static constexpr std::size_t CHUNK_EVENTS = 512;
+
+   private:
+    // Payloads shorter than this (tempo, time and key signatures, SMPTE
+    // offsets...) are kept in the column along with their null char
+    static constexpr v_len INLINE_PAYLOAD = sizeof(const u8 *);
+
+    union Payload {
+        // Variable length, then the bytes, either in the source file or in
+        // the arena (followed by a null char there)
+        const u8 *data;
+        u8 bytes[INLINE_PAYLOAD];
+    };
+
+    struct Chunk {
+        u32 count = 0;
+        v_len deltas[CHUNK_EVENTS];
+        // Sum of the deltas up to each event, from the start of the chunk
+        v_len ticks[CHUNK_EVENTS];
+        u8 statuses[CHUNK_EVENTS], data0s[CHUNK_EVENTS], data1s[CHUNK_EVENTS];
+        // Edited payloads are copied to the arena rather than written over
+        // the source, replaced ones are left behind until the document is
+        // dropped
+        Payload payloads[CHUNK_EVENTS];
+
+        inline v_len span() const { return count > 0 ? ticks[count - 1] : 0; }
+        inline bool isInline(std::size_t k) const {
+            return statuses[k] >= SYSEX && (data1s[k] & 0x80);
+        }
+        // Moves n events of every column, the ticks are left to the caller
+        void move(std::size_t to, std::size_t from, std::size_t n);
+        // Appends n events of another chunk
+        void append(const Chunk &other, std::size_t from, std::size_t n);
+        void computeTicks(std::size_t from);
+    };
+
+    // Chunks shared with another store are copied before any change
+    std::vector<std::shared_ptr<Chunk>> chunks;
+    std::size_t events = 0;
+    // Tick the first delta starts from, not 0 for ranges of a track
+    v_len origin = 0;
+
+    // Fenwick trees over the event counts and tick spans of the chunks,
+    // rebuilt on the next lookup once chunks are added or removed
+    mutable std::vector<std::size_t> countTree;
+    mutable std::vector<v_len> spanTree;
+    mutable bool indexed = false;
+
+    // Chunk of the last lookup, sequential passes only step to the next one
+    mutable std::size_t cacheChunk = 0, cacheFirst = 0, cacheEnd = 0;
+    mutable v_len cacheTick = 0;
+
+    ArenaAllocator allocator;
+
+    bool edited = false;
+    u32 generation = 0;
+
+    inline const Chunk &chunkAt(std::size_t i, std::size_t &k) const {
+        if (i < cacheFirst || i >= cacheEnd) seek(i);
+        k = i - cacheFirst;
+        return *chunks[cacheChunk];
+    }
+    // For changes, the chunk is no longer shared once returned
+    inline Chunk &chunkAt(std::size_t i, std::size_t &k) {
+        if (i < cacheFirst || i >= cacheEnd) seek(i);
+        k = i - cacheFirst;
+        return writableChunk(cacheChunk);
+    }
+    inline Chunk &writableChunk(std::size_t c) {
+        if (chunks[c].use_count() > 1)
+            chunks[c] = std::make_shared<Chunk>(*chunks[c]);
+        else
+            // The last copy may have just been dropped by another thread,
+            // whose reads must be over before the chunk is written
+            std::atomic_thread_fence(std::memory_order_acquire);
+        return *chunks[c];
+    }
+    void seek(std::size_t i) const;
+    void buildIndex() const;
+    // Point updates of the index after chunk c changed in place
+    void chunkChanged(std::size_t c, std::ptrdiff_t count, v_len span);
+    // Chunks were added or removed
+    inline void chunksMoved() {
+        indexed = false;
+        cacheFirst = cacheEnd = 0;
+    }
+    Chunk &appendSlot();
+
+    // Returns the data1 byte to store along with the payload
+    u8 storePayload(const u8 *data, v_len length, Payload &res);
+    void writeEvent(Chunk &chunk, std::size_t k, const struct TrackEvent &e);
+};
+
+// Events between two checkpoints of a track index
+#define TRACK_INDEX_INTERVAL 1024
+
+// Position in the raw bytes of a track, between two events
+struct TrackCursor {
+    u32 offset;  // On the delta of the next event
+    v_len time;  // Absolute tick of the previous event
+    u8 running;  // Running status, 0 if none
+};
+
+// Sparse index over the raw bytes of a track, checkpoint k is right before
+// event k * TRACK_INDEX_INTERVAL
+// Never changes once built, so copies of the track share it
+struct TrackIndex {
+    std::shared_ptr<const std::vector<struct TrackCursor>> checkpoints;
+    u32 events = 0;
+
+    inline bool built() const { return checkpoints != nullptr; }
+};
+
+struct BarTime {
+    u32 bar;
+    double barTime;
+};
+
+// Absolute time and musical position of a window of events of a track,
+// derived from their ticks and the time maps of the file, see
+// updateTrackTimes()
+// Kept by whoever shows the track rather than in it, so that reading a
+// version of the file never writes to it
+struct TrackTimes {
+    // Event of micros[0] and bars[0]
+    std::size_t first = 0;
+    std::vector<u64> micros;
+    std::vector<struct BarTime> bars;
+    // What they were computed from
+    u32 mapsVersion = 0, ticksGeneration = 0;
+
+    inline u64 microsAt(std::size_t i) const { return micros[i - first]; }
+    inline const struct BarTime &barAt(std::size_t i) const {
+        return bars[i - first];
+    }
+};
+
 struct MidiTrack {
     u32 length;
 
     bool decoded;
-    // TODO fix that thing
-    u8 *data;  // Not owned
-    std::vector<TrackEvent> list;
+    const u8 *data;  // Not owned, points into MidiFile::source
+    EventStore list;
+
+    // Over data, so edits of list do not invalidate it
+    struct TrackIndex index;
+
+    // Events in list once decoded, or found when indexing the raw bytes
+    inline std::size_t size() const {
+        return decoded ? list.size() : index.events;
+    }
+
+    // Whether list no longer matches data, saving only encodes those tracks
+    inline bool modified() const { return data == NULL || list.isEdited(); }
 
     MidiTrack() : length(0), decoded(false), data(NULL) {}
 
+    // The copy shares the chunks of the events
+    MidiTrack(const MidiTrack &t)
+        : length(t.length),
+          decoded(t.decoded),
+          data(t.data),
+          list(t.list),
+          index(t.index) {}
+
     MidiTrack(MidiTrack &&t)
         : length(t.length),
           decoded(t.decoded),
           data(t.data),
-          list(std::move(t.list)) {}
+          list(std::move(t.list)),
+          index(std::move(t.index)) {}
 
     MidiTrack &operator=(MidiTrack &&t) {
         this->length = t.length;
         this->decoded = t.decoded;
         this->data = t.data;
         this->list = std::move(t.list);
+        this->index = std::move(t.index);
         return *this;
     }
 };
 
+// Track of the 120 bpm tempo and 4/4 time signature changes added when none
+// is set at tick 0
+#define DEFAULT_MAP_TRACK 0xFFFF
+
 struct TempoChange {
     v_len time;
     u64 timeMicros;
     double microsPerTick;
+    // Changes at the same tick are ordered by track
+    u16 track = DEFAULT_MAP_TRACK;
 };
 
 struct TimeSignatureChange {
     v_len time;
-    u16 bar;
+    u32 bar;
     struct TimeSignature signature;
+    u16 track = DEFAULT_MAP_TRACK;
 };
 
 struct MidiFile {
@@ -408,17 +719,33 @@ struct MidiFile {
 
     // Should be an array of tracks for multi-track files
     struct MidiTrack *data = nullptr;
+    // Instead of data for versions made by snapshotMidiFile(), which share
+    // the tracks that did not change with the version before them
+    std::vector<std::shared_ptr<const struct MidiTrack>> sharedTracks;
+
+    inline const struct MidiTrack &track(u32 i) const {
+        return data != nullptr ? data[i] : *sharedTracks[i];
+    }
+
+    // Bytes the tracks were read from, kept alive with the document
+    // Shared since decoded events keep pointing into it
+    std::shared_ptr<MappedFile> source;
 
     // TODO put that in track data for type 2 files
     std::vector<TempoChange> timingInfo;
     std::vector<TimeSignatureChange> timeSignatureInfo;
+    // Changes every time one of the maps does
+    u32 timeMapsVersion = 0;
+
+    // Meta and sysex payloads of every track, freed with the document
+    Arena arena;
+    // For versions made by snapshotMidiFile(), the document they were taken
+    // from, whose arena their payloads are in
+    std::shared_ptr<const struct MidiFile> owner;
+
     ~MidiFile() { delete[] data; }
 };
 
-struct BarTime {
-    u16 bar;
-    double barTime;
-};
 
 #pragma endregion
 
@@ -431,22 +758,114 @@ struct BarTime {
 #define READ_BIG_ENDIAN_U24(data) ((data[0] << 16) + (data[1] << 8) + data[2])
 #define READ_BIG_ENDIAN_U16(data) ((data[0] << 8) + data[1])
 
-enum MidiError readMidiFile(u8 *data, std::size_t length,
+enum MidiError readMidiFile(const u8 *data, std::size_t length,
                             struct MidiFile *&res);
 
-enum MidiError decodeTrack(struct MidiFile &file, struct MidiTrack &track);
-
-void computeTimes(std::vector<TrackEvent> &track);
-
-void computeTimeMapsForTrack(struct MidiFile &file, struct MidiTrack &track);
-void computeTimeSignatureMapForTrack(struct MidiFile &file,
-                                     struct MidiTrack &track);
-void computeTimingMapForTrack(struct MidiFile &file, struct MidiTrack &track);
+// Does not touch the time maps of the file
+enum MidiError decodeTrack(struct MidiTrack &track);
+// Builds the checkpoint index of a track from its raw bytes, also done by the
+// first decoding of the track
+enum MidiError indexTrack(struct MidiTrack &track);
+// Decodes the track the first time it is needed
+enum MidiError ensureTrackDecoded(struct MidiTrack &track);
+// Replaces the content of res by count events of the track starting at event
+// first, decoded from the raw bytes through the index
+enum MidiError decodeTrackRange(struct MidiTrack &track, u32 first, u32 count,
+                                EventStore &res);
+// First event at or after the tick, size() if none
+// Searches the events of decoded tracks, otherwise their raw bytes
+enum MidiError findEventAtTick(struct MidiTrack &track, v_len tick,
+                               u32 &event);
+// Counts the events of a track without decoding them
+enum MidiError countMidiMessages(const u8 *data, const u8 *end, u32 &count);
+// Decodes every track on the pool then rebuilds the time maps
+enum MidiError decodeTracks(struct MidiFile &file, ThreadPool &pool);
+// Indexes every track and builds the time maps from their raw bytes without
+// decoding them, tracks are then decoded with ensureTrackDecoded
+enum MidiError scanTracks(struct MidiFile &file, ThreadPool &pool);
+
+
+// Rebuild the file's time maps from the events of all its tracks
+void computeTimeMaps(struct MidiFile &file);
+void computeTimeSignatureMap(struct MidiFile &file);
+void computeTimingMap(struct MidiFile &file);
+// Keep timingInfo in sync with an edit of a decoded track without collecting
+// the events again, only the tempo changes after the edit are recomputed
+// They return false when the edit moved later tempo changes of the track, the
+// map then has to be rebuilt with computeTimingMap
+// After the event was inserted
+bool updateTimingMapOnInsert(struct MidiFile &file, u16 track,
+                             std::size_t event);
+// Before the event is erased
+bool updateTimingMapOnErase(struct MidiFile &file, u16 track,
+                            std::size_t event);
+// After the event was set, its time must not have changed
+bool updateTimingMapOnSet(struct MidiFile &file, u16 track, std::size_t event);
+// Rebuild both time maps after any number of edits to some tracks, only the
+// changes of those tracks are collected again, the others are kept
+// The tracks must not have been added, removed or moved since the maps were
+// built
+void updateTimeMaps(struct MidiFile &file, const std::vector<u16> &tracks);
+// Same as getTimeMicros and getBar for n ticks in increasing order, resolved
+// with a single sweep over the map rather than a search per tick
+void getTimesMicros(const std::vector<TempoChange> &timingInfo,
+                    const v_len *ticks, std::size_t n, u64 *res);
+void getBars(const std::vector<TimeSignatureChange> &timeSignatureInfo,
+             const v_len *ticks, std::size_t n, struct BarTime *res);
+// Makes times hold events [first, first + count) of a decoded track, only
+// computing them again if they are not in the window or if the ticks or the
+// time maps changed since
+void updateTrackTimes(const struct MidiFile &file,
+                      const struct MidiTrack &track, struct TrackTimes &times,
+                      std::size_t first, std::size_t count);
+// What the last version made by snapshotMidiFile() was taken from
+struct SnapshotState {
+    std::shared_ptr<const struct MidiFile> file;
+    std::vector<std::shared_ptr<const struct MidiTrack>> tracks;
+    u32 length = 0;
+    u16 format = 0, division = 0;
+    u32 timeMapsVersion = 0;
+};
+// Version of the file as it is now, sharing its events, that one other thread
+// can read while the file keeps being edited
+// Tracks whose events did not change since the last version are shared with
+// it, and null is returned when nothing did
+// Lookups move the cursors of its event stores, so it is not meant to be read
+// by several threads at once
+std::unique_ptr<const struct MidiFile> snapshotMidiFile(
+    const std::shared_ptr<struct MidiFile> &file, struct SnapshotState &last);
 
 // XXX make an operator?
 enum MidiError encodeTrackEvent(const struct TrackEvent &event,
                                 std::stringstream &stream);
-enum MidiError writeMidiFile(struct MidiFile &file, std::ostream &stream);
+// Writes event i at out and returns the end of what was written, which is
+// exactly encodedEventSize(events, i) bytes
+u8 *encodeTrackEvent(const EventStore &events, std::size_t i, u8 *out);
+std::size_t encodedEventSize(const EventStore &events, std::size_t i);
+
+// Fill the fields of a meta event from its raw payload
+void readMetaPayload(struct MetaEvent &meta, const u8 *data, v_len length);
+// Returns the length of the raw payload of a meta event, fixed size events
+// are written to buffer and others point to their data
+v_len writeMetaPayload(const struct MetaEvent &meta, u8 *buffer,
+                       const u8 *&data);
+// Only applies to the tracks that get encoded again, unmodified ones are
+// copied as they were read
+struct WriteOptions {
+    // Leave out the status byte of channel messages repeating the previous one
+    bool runningStatus = true;
+    // Write note offs as velocity 0 note ons when that continues a run of note
+    // ons, smaller but their release velocity is lost
+    bool noteOffAsNoteOn = false;
+};
+
+enum MidiError writeMidiFile(
+    struct MidiFile &file, std::ostream &stream,
+    const struct WriteOptions &options = WriteOptions());
+// Encodes the tracks on the pool then writes the whole file at once
+enum MidiError writeMidiFile(
+    struct MidiFile &file, ThreadPool &pool, OutputFile &output,
+    const struct WriteOptions &options = WriteOptions());
 
 void printMidiFile(const struct MidiFile &header);
 
@@ -464,40 +883,46 @@ inline double getMicrosPerTick(u16 division, u32 MPB) {
     }
 }
 
+// Perform BSearch to find last event whose field is at most key, the first
+// one if there are none, the field must never decrease
+// Branchless so that random queries do not pay for a mispredict at every
+// step, the select compiles to a conditional move
+template <typename T, typename K>
+const T &getLastBefore(const std::vector<T> &events, K key, K T::*field) {
+    if (events.empty()) throw std::runtime_error("Empty list to BSearch in !");
+    const T *base = events.data();
+    std::size_t n = events.size();
+    while (n > 1) {
+        const std::size_t half = n / 2;
+        base = (base[half].*field <= key) ? base + half : base;
+        n -= half;
+    }
+    return *base;
+}
+
 // Perform BSearch to find last event just before a time
 template <typename T>
 const T &getLastBefore(const std::vector<T> &events, v_len time) {
-    if (events.empty()) throw std::runtime_error("Empty list to BSearch in !");
-    std::size_t idx = 0, idx2 = events.size() - 1;
-    std::size_t mid = (idx + idx2) / 2;
-    while (idx + 1 < idx2) {
-        if (events[mid].time > time) {
-            idx2 = mid;
-        } else {
-            idx = mid;
-        }
-        mid = (idx + idx2) / 2;
-    }
-    if (events[idx2].time <= time) {
-        return events[idx2];
-    }
-    if (idx2 > 0) return events[idx2 - 1];
-    return events[0];
+    return getLastBefore(events, time, &T::time);
 }
 
-inline struct BarTime getBar(
-    const std::vector<TimeSignatureChange> &timeSignatureInfo, v_len time) {
+inline struct BarTime getBar(const TimeSignatureChange &sig, v_len time) {
     if (time == 0) return BarTime{.bar = 0, .barTime = 0};
-    const struct TimeSignatureChange &sig =
-        getLastBefore<TimeSignatureChange>(timeSignatureInfo, time);
     double bar =
         sig.bar + (time - sig.time) * (1 << sig.signature.denominator) /
                       (double)sig.signature.TPM / sig.signature.numerator / 16;
-    return BarTime{.bar = (u16)bar,
-                   .barTime = (bar - (u16)bar) * sig.signature.numerator /
+    return BarTime{.bar = (u32)bar,
+                   .barTime = (bar - (u32)bar) * sig.signature.numerator /
                               (1 << sig.signature.denominator) * 4};
 }
 
+inline struct BarTime getBar(
+    const std::vector<TimeSignatureChange> &timeSignatureInfo, v_len time) {
+    if (time == 0) return BarTime{.bar = 0, .barTime = 0};
+    return getBar(getLastBefore<TimeSignatureChange>(timeSignatureInfo, time),
+                  time);
+}
+
 inline u64 getTimeMicros(const std::vector<TempoChange> &timingInfo,
                          v_len time) {
     if (time == 0) return 0;
@@ -510,4 +935,63 @@ inline u64 getTimeMicros(const TempoChange &lastTempoChange, v_len time) {
            lastTempoChange.timeMicros;
 }
 
+// Inverse of getTimeMicros, first tick at or after the time
+inline v_len getTickAtMicros(const std::vector<TempoChange> &timingInfo,
+                             u64 micros) {
+    const struct TempoChange &timing =
+        getLastBefore(timingInfo, micros, &TempoChange::timeMicros);
+    if (micros <= timing.timeMicros || timing.microsPerTick <= 0)
+        return timing.time;
+    double ticks = (micros - timing.timeMicros) / timing.microsPerTick;
+    v_len tick = (v_len)std::min<double>(timing.time + ticks, UINT32_MAX);
+    // getTimeMicros truncates, so the division can be off by one
+    while (tick > timing.time && getTimeMicros(timing, tick - 1) >= micros)
+        tick--;
+    while (tick < UINT32_MAX && getTimeMicros(timing, tick) < micros) tick++;
+    return tick;
+}
+
+// Ticks after the change at which getBar returns the bar and beat
+inline double getTicksIntoBar(const TimeSignatureChange &sig,
+                              const struct BarTime &bar) {
+    const double beats = 1 << sig.signature.denominator;
+    double bars = (double)bar.bar - sig.bar +
+                  bar.barTime * beats / sig.signature.numerator / 4;
+    // Rounding errors should not push exact positions to the next tick
+    return std::ceil(bars * sig.signature.TPM * sig.signature.numerator * 16 /
+                         beats -
+                     1e-6);
+}
+
+// Inverse of getBar, first tick at or after the bar and beat
+inline v_len getTickAtBar(
+    const std::vector<TimeSignatureChange> &timeSignatureInfo,
+    const struct BarTime &bar) {
+    const struct TimeSignatureChange *last =
+        &getLastBefore(timeSignatureInfo, bar.bar, &TimeSignatureChange::bar);
+    // Changes restart from the bar they fall in, so the position can be
+    // reached from every change in that bar and from the one before them,
+    // the earliest tick that getBar really maps to the bar wins
+    bool found = false;
+    v_len best = UINT32_MAX;
+    for (const struct TimeSignatureChange *sig = last;; sig--) {
+        const double tick =
+            sig->time + std::max(getTicksIntoBar(*sig, bar), 0.0);
+        const bool inRange = sig == &timeSignatureInfo.back() ||
+                             tick < (sig + 1)->time;
+        if (inRange && tick < UINT32_MAX &&
+            getBar(timeSignatureInfo, (v_len)tick).bar == bar.bar &&
+            (!found || (v_len)tick < best)) {
+            best = (v_len)tick;
+            found = true;
+        }
+        if (sig == timeSignatureInfo.data() || sig->bar < bar.bar) break;
+    }
+    if (found) return best;
+    // Past the end of the bar
+    double ticks = getTicksIntoBar(*last, bar);
+    if (ticks <= 0) return last->time;
+    return (v_len)std::min<double>(last->time + ticks, UINT32_MAX);
+}
+
 #endif /* MIDIFILE_H */
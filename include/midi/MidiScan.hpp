@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+
+#include "Ints.hpp"
+
+// Byte scanning kernels used to skip over plain data bytes quickly
+// AVX2 or SSE2 is used when the compiler targets it (-mavx2, -march=native)
+
+// Number of bytes from data before the first one with its high bit set
+// (a status byte or a varlen continuation), or before end
+std::size_t countDataBytes(const u8* data, const u8* end);
+
+// Byte by byte version, used for the tails of the vectorized loops
+std::size_t countDataBytesScalar(const u8* data, const u8* end);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+
+#include "MidiFile.hpp"
+
+// What a byte means when it is found where a status byte is expected
+// Shared by the decoder, the pre-scan and the encoders so that they always
+// agree on message lengths
+
+// Channel messages, the only ones that can be followed by running status
+#define STATUS_RUNNING 0x1
+// Meta and sysex events, followed by a variable length then their payload
+// (after the meta type for meta events)
+#define STATUS_PAYLOAD 0x2
+
+struct StatusInfo {
+    u8 kind;    // enum TrackEventType, UNKOWN for data bytes
+    u8 length;  // Data bytes following the status byte
+    u8 flags;
+};
+
+constexpr struct StatusInfo makeStatusInfo(u8 status) {
+    if (status < 0x80) return {UNKOWN, 0, 0};
+    if (status < SYSEX) {
+        const u8 t = status >> 4;
+        return {MIDI, (u8)(t == PROGRAM_CHANGE || t == AFTERTOUCH ? 1 : 2),
+                STATUS_RUNNING};
+    }
+    if (status == 0xFF) return {META, 0, STATUS_PAYLOAD};
+    if (status == SYSEX || status == SYSEX_END)
+        return {SYSEX_EVENT, 0, STATUS_PAYLOAD};
+    if (status == SONG_POSITION) return {SYSTEM_EVENT, 2, 0};
+    if (status == SONG_SELECT) return {SYSTEM_EVENT, 1, 0};
+    return {SYSTEM_EVENT, 0, 0};
+}
+
+constexpr std::array<struct StatusInfo, 256> makeStatusTable() {
+    std::array<struct StatusInfo, 256> res{};
+    for (int i = 0; i < 256; i++) res[i] = makeStatusInfo(i);
+    return res;
+}
+
+inline constexpr std::array<struct StatusInfo, 256> STATUS_TABLE =
+    makeStatusTable();
+
+static_assert(STATUS_TABLE[0x90].length == 2 && STATUS_TABLE[0xC5].length == 1);
+static_assert(STATUS_TABLE[0xF2].length == 2 && STATUS_TABLE[0xF8].length == 0);
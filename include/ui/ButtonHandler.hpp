@@ -29,13 +29,17 @@ class ButtonHandler {
         this->statuses[buttonID].pressed = true;
     }
 
-    void runAll() {
+    // Returns whether any button was pressed
+    bool runAll() {
+        bool ran = false;
         for (std::pair<const std::string, ButtonHandle> &pair : statuses) {
             if (pair.second.pressed) {
                 pair.second.handler();
                 pair.second.pressed = false;
+                ran = true;
             }
         }
+        return ran;
     }
 
    private:
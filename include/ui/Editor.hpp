@@ -11,12 +11,19 @@
 #include <GLFW/glfw3.h>
 
 #include <atomic>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <vector>
 
 #include "ButtonHandler.hpp"
+#include "EditHistory.hpp"
 #include "MidiFile.hpp"
+#include "Publisher.hpp"
 #include "ResourceManager.hpp"
+#include "ThreadPool.hpp"
 #include "ToolStrip.hpp"
 
 // FIXME split this into multiple classes with references to main class' data
@@ -35,13 +42,17 @@ class Editor {
     void loadFile(std::string path);
     void saveFile(std::string path);
 
+    // The document is only touched by the thread running update(), which
+    // publishes a version of it after every batch of edits, render() only
+    // reads the last one
     void setData(std::shared_ptr<MidiFile> ptr) {
+        this->history.clear();
+        this->unpublished = true;
         std::atomic_store(&data, ptr);
         this->totalEvents = 0;
         if (!ptr) return;
         for (u32 track = 0; track < data->tracks; track++) {
-            if (data->data[track].decoded)
-                totalEvents += data->data[track].list.size();
+            totalEvents += data->data[track].size();
         }
     }
     std::shared_ptr<MidiFile> getData() const {
@@ -65,6 +76,31 @@ class Editor {
     void removeEvent(u16 track, u32 pos);
     void addTrack(u16 idx);
     void removeTrack(u16 idx);
+    void swapTracks(u16 a, u16 b);
+    void setEvent(u16 track, u32 pos, const TrackEvent& e);
+    void setDeltaTime(u16 track, u32 pos, v_len delta);
+
+    // Runs the task in the next update(), for the edits asked by render()
+    void runOnUpdate(std::function<void()> task);
+
+    // Edits made until the matching commitEdit() only update the time maps
+    // and the event count once, at commit, for the tracks they touched
+    // Transactions nest, the outermost commit applies them
+    void beginEdit();
+    void commitEdit();
+
+    // Every call to addEvent() and removeEvent() outside of a transaction, or
+    // every transaction, is a step
+    void undo();
+    void redo();
+    // Bytes the history may hold, see EditHistory
+    void setUndoBudget(std::size_t bytes) { history.setBudget(bytes); }
+
+    // Moves the table to the first event at or after the tick, in the shown
+    // track or in the selected one when all tracks are shown
+    void jumpToTick(v_len tick);
+    // Kept within the rows of the tracks shown
+    void setOffset(u64 row);
 
     void deleteSelectedEvent() {
         removeEvent(this->selectedTrack, this->selectedEvent);
@@ -80,11 +116,15 @@ class Editor {
 
     std::string errorString;
 
-    u64 eventTableSize = 500, offset = 0;
-    u64 totalEvents = 0;
+    // Rows shown, also read by update() to decode the tracks they are in
+    // The offset is only written by update(), render() queues its changes
+    std::atomic<u64> eventTableSize = 500, offset = 0;
+    double jumpSeconds = 0, jumpBeat = 0;
+    int jumpBar = 0;
+    std::atomic<u64> totalEvents = 0;
 
     bool showAllTracks = true;
-    u32 trackToShow = 0;
+    std::atomic<u32> trackToShow = 0;
 
     ButtonHandler buttonHandler;
 
@@ -92,22 +132,67 @@ class Editor {
 
     ToolStrip toolStrip;
 
+    // Used to decode and encode the tracks of files in parallel
+    ThreadPool workers;
+
+    // Edited by render(), saves use the copy last sent to update()
+    struct WriteOptions writeOptions, saveOptions;
+
     bool trackEditorOpen = false;
 
     bool addEventEditorOpen = false;
-    u32 selectedTrack = 0, selectedEvent = 0;
+    std::atomic<u32> selectedTrack = 0, selectedEvent = 0;
 
     bool tempoHasChanged = false, timeSignatureHasChanged = false;
 
+    // Open transactions, see beginEdit()
+    u32 editDepth = 0;
+    // Tracks touched by the transaction with their size before it
+    std::map<u16, std::size_t> editedTracks;
+    // Tracks were added or removed, every map is rebuilt at commit
+    bool editMovedTracks = false;
+
+    EditHistory history;
+
+    // Called before the first edit of a track in a transaction
+    void touchTrack(const MidiFile& file, u16 track);
+    // Around any edit of a track, so that it can be undone
+    void beginTrackEdit(const MidiFile& file, u16 track);
+    void endTrackEdit(const MidiFile& file);
+    // After undo or redo put tracks back
+    void tracksRestored(MidiFile& file, const std::vector<u16>& tracks);
+
+    // Versions of the document handed to render()
+    Publisher<const MidiFile> published;
+    // The document may have changed since the last version was published
+    bool unpublished = false;
+    struct SnapshotState lastPublished;
+
+    std::mutex tasksMutex;
+    std::vector<std::function<void()>> tasks;
+
+    // Times of the rows shown, for each track, only used by render()
+    std::vector<struct TrackTimes> tableTimes;
+    // Text of the meta event shown in a row, only used by render()
+    std::string tableText;
+
+    // Each return whether the document changed
+    bool runTasks();
+    bool decodeShownTracks(MidiFile& file);
+
     std::string error;
 
     bool printDataTextForTrackEvent(TrackEvent& ev);
-    void printTextForTrackEventType(const TrackEvent& ev);
-
-    void renderFileParams(std::shared_ptr<MidiFile>& data);
-    void renderTable(std::shared_ptr<MidiFile>& data);
-    void renderParams(std::shared_ptr<MidiFile>& data);
-    void renderTrackEditor(std::shared_ptr<MidiFile>& data);
-    void renderEventAddEditor(std::shared_ptr<MidiFile>& data);
+    bool printDataTextForMetaEvent(MetaEvent& meta);
+    // Set edited to the event of row i if its input changed
+    bool printDataTextForEvent(const EventStore& list, std::size_t i,
+                               TrackEvent& edited);
+    void printTextForTrackEventType(const EventStore& list, std::size_t i);
+
+    void renderFileParams(const MidiFile* data);
+    void renderTable(const MidiFile* data);
+    void renderParams(const MidiFile* data);
+    void renderTrackEditor(const MidiFile* data);
+    void renderEventAddEditor(const MidiFile* data);
     void renderError();
 };
\ No newline at end of file
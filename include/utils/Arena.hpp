@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Ints.hpp"
+
+// Owns blocks of memory that are only ever freed all at once
+// Allocations go through an ArenaAllocator so that threads only lock the arena
+// when they need a new block
+class Arena {
+   public:
+    Arena(std::size_t blockSize = 1 << 16);
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Thread safe, the block stays valid until release()
+    u8* newBlock(std::size_t size);
+
+    // Frees every block, any pointer given out before becomes dangling
+    void release();
+
+    inline std::size_t blockSize() const { return defaultSize; }
+    std::size_t bytesAllocated();
+
+   private:
+    std::size_t defaultSize;
+    std::size_t allocated = 0;
+    std::vector<std::unique_ptr<u8[]>> blocks;
+    std::mutex mutex;
+};
+
+// Bump allocator over the blocks of an Arena
+// Not thread safe, use one per thread or per track
+class ArenaAllocator {
+   public:
+    ArenaAllocator(Arena* arena = nullptr) : arena(arena) {}
+
+    // Copies share the arena but never the current block
+    ArenaAllocator(const ArenaAllocator& cpy) : arena(cpy.arena) {}
+    ArenaAllocator& operator=(const ArenaAllocator& cpy) {
+        arena = cpy.arena;
+        cursor = limit = nullptr;
+        return *this;
+    }
+    ArenaAllocator(ArenaAllocator&& mov)
+        : arena(mov.arena), cursor(mov.cursor), limit(mov.limit) {
+        mov.cursor = mov.limit = nullptr;
+    }
+    ArenaAllocator& operator=(ArenaAllocator&& mov) {
+        arena = mov.arena;
+        cursor = mov.cursor;
+        limit = mov.limit;
+        mov.cursor = mov.limit = nullptr;
+        return *this;
+    }
+
+    inline Arena* getArena() const { return arena; }
+
+    u8* allocate(std::size_t size, std::size_t align = alignof(u32));
+
+   private:
+    Arena* arena;
+    u8* cursor = nullptr;
+    u8* limit = nullptr;
+};
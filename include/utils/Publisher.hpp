@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+// Hands the latest version of an object from one writer thread to one reader
+// thread without locks
+// A version is only ever owned by one side: the writer until it is taken, the
+// reader from then on, so no version is freed while being read
+template <typename T>
+class Publisher {
+   public:
+    Publisher() {}
+
+    Publisher(const Publisher&) = delete;
+    Publisher& operator=(const Publisher&) = delete;
+
+    // Writer side, a version the reader did not take yet is dropped
+    void publish(std::unique_ptr<T> version) {
+        std::unique_ptr<T> stale(
+            latest.exchange(version.release(), std::memory_order_acq_rel));
+    }
+
+    // Reader side, takes the last version published if there is a new one
+    // The result stays valid until the next call
+    T* read() {
+        T* next = latest.exchange(nullptr, std::memory_order_acq_rel);
+        if (next) current.reset(next);
+        return current.get();
+    }
+
+    ~Publisher() { delete latest.load(); }
+
+   private:
+    std::atomic<T*> latest = nullptr;
+    std::unique_ptr<T> current;
+};
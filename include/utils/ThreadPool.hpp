@@ -0,0 +1,38 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that outlive the jobs given to them
+class ThreadPool {
+   public:
+    // 0 means one worker per hardware thread
+    ThreadPool(unsigned threads = 0);
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> job);
+
+    // Calls fn(i) for every i in [0, n) and returns once all calls are done
+    // The calling thread takes part in the work
+    void parallelFor(std::size_t n, const std::function<void(std::size_t)>& fn);
+
+    inline std::size_t size() const { return workers.size(); }
+
+    ~ThreadPool();
+
+   private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping = false;
+
+    void work();
+};
@@ -0,0 +1,83 @@
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+
+bool MappedFile::open(const std::string& path) {
+    close();
+    // Sharing delete lets a save rename the file aside while it is mapped
+    HANDLE f = CreateFileA(path.c_str(), GENERIC_READ,
+                           FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                           OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (f == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(f, &sz) || sz.QuadPart == 0) {
+        CloseHandle(f);
+        return false;
+    }
+
+    HANDLE m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m == NULL) {
+        CloseHandle(f);
+        return false;
+    }
+    void* view = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL) {
+        CloseHandle(m);
+        CloseHandle(f);
+        return false;
+    }
+
+    this->file = f;
+    this->mapping = m;
+    this->ptr = (const u8*)view;
+    this->length = sz.QuadPart;
+    return true;
+}
+
+void MappedFile::close() {
+    if (ptr) UnmapViewOfFile(ptr);
+    if (mapping) CloseHandle(mapping);
+    if (file) CloseHandle(file);
+    ptr = nullptr;
+    mapping = file = nullptr;
+    length = 0;
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool MappedFile::open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* view = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if (view == MAP_FAILED) return false;
+
+    // Tracks are parsed front to back so let the kernel read ahead
+    madvise(view, st.st_size, MADV_SEQUENTIAL);
+    madvise(view, st.st_size, MADV_WILLNEED);
+
+    this->ptr = (const u8*)view;
+    this->length = st.st_size;
+    return true;
+}
+
+void MappedFile::close() {
+    if (ptr) munmap((void*)ptr, length);
+    ptr = nullptr;
+    length = 0;
+}
+#endif
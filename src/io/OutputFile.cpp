@@ -0,0 +1,239 @@
+#include "OutputFile.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+
+#ifdef _WIN32
+#include <windows.h>
+
+bool OutputFile::open(const std::string& path) {
+    close();
+    HANDLE f = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                           NULL);
+    if (f == INVALID_HANDLE_VALUE) return false;
+    this->file = f;
+    return true;
+}
+
+bool OutputFile::create(const std::string& path) {
+    close();
+    HANDLE f = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                           NULL);
+    if (f == INVALID_HANDLE_VALUE) return false;
+    this->file = f;
+    return true;
+}
+
+// Attributes are not carried over by the rename anyway
+bool OutputFile::copyModeOf(const std::string&) { return true; }
+
+bool OutputFile::close() {
+    if (!file) return true;
+    bool res = CloseHandle(file);
+    file = nullptr;
+    return res;
+}
+
+bool OutputFile::write(const std::vector<struct OutputChunk>& chunks) {
+    for (const struct OutputChunk& chunk : chunks) {
+        std::size_t done = 0;
+        while (done < chunk.size) {
+            DWORD n = 0;
+            DWORD len = (DWORD)std::min<std::size_t>(chunk.size - done,
+                                                     1u << 30);
+            if (!WriteFile(file, chunk.data + done, len, &n, NULL) || n == 0)
+                return false;
+            done += n;
+        }
+    }
+    return true;
+}
+
+bool OutputFile::reserve(u64 size) {
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = size;
+    // Only a hint, not every file system supports it
+    SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info));
+    return true;
+}
+
+bool OutputFile::sync() { return FlushFileBuffers(file); }
+
+// Unlike a POSIX rename, a file still mapped (the document being saved over)
+// can not be replaced, only renamed, so it is moved aside first and deleted
+// once the last view of it is closed
+static bool replaceFile(const std::string& from, const std::string& to) {
+    constexpr DWORD FLAGS = MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH;
+    if (MoveFileExA(from.c_str(), to.c_str(), FLAGS)) return true;
+    // The temporary file name is unique, so is this one
+    const std::string aside = from + ".old";
+    if (!MoveFileExA(to.c_str(), aside.c_str(), MOVEFILE_WRITE_THROUGH))
+        return false;
+    if (!MoveFileExA(from.c_str(), to.c_str(), FLAGS)) {
+        MoveFileExA(aside.c_str(), to.c_str(), FLAGS);
+        return false;
+    }
+    DeleteFileA(aside.c_str());
+    return true;
+}
+
+static void syncDirectory(const std::string&) {}
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+bool OutputFile::open(const std::string& path) {
+    close();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return fd >= 0;
+}
+
+bool OutputFile::create(const std::string& path) {
+    close();
+    // The umask still applies, as for any new file
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    return fd >= 0;
+}
+
+bool OutputFile::copyModeOf(const std::string& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) return errno == ENOENT;
+    return fchmod(fd, st.st_mode & 07777) == 0;
+}
+
+bool OutputFile::close() {
+    if (fd < 0) return true;
+    bool res = ::close(fd) == 0;
+    fd = -1;
+    return res;
+}
+
+bool OutputFile::write(const std::vector<struct OutputChunk>& chunks) {
+    std::vector<struct iovec> vecs;
+    vecs.reserve(chunks.size());
+    for (const struct OutputChunk& chunk : chunks) {
+        if (chunk.size > 0)
+            vecs.push_back(iovec{(void*)chunk.data, chunk.size});
+    }
+
+    // Short writes leave the first remaining vector partially written
+    std::size_t first = 0;
+    while (first < vecs.size()) {
+        // Empty vectors are dropped above, but never start a call with one
+        if (vecs[first].iov_len == 0) {
+            first++;
+            continue;
+        }
+        const int count = std::min<std::size_t>(vecs.size() - first, IOV_MAX);
+        ssize_t n = ::writev(fd, vecs.data() + first, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        // Nothing written while something was left, retrying would spin
+        if (n == 0) return false;
+        while (n > 0 && (std::size_t)n >= vecs[first].iov_len) {
+            n -= vecs[first].iov_len;
+            first++;
+        }
+        if (n > 0) {
+            vecs[first].iov_base = (u8*)vecs[first].iov_base + n;
+            vecs[first].iov_len -= n;
+        }
+    }
+    return true;
+}
+
+bool OutputFile::reserve(u64 size) {
+#if defined(__linux__) || defined(__FreeBSD__)
+    if (size == 0) return true;
+    int err;
+    do {
+        err = posix_fallocate(fd, 0, size);
+    } while (err == EINTR);
+    // Not supported by this file system, the writes will allocate instead
+    return err == 0 || err == EINVAL || err == EOPNOTSUPP;
+#else
+    (void)size;
+    return true;
+#endif
+}
+
+bool OutputFile::sync() {
+    int res;
+    do {
+        res = fsync(fd);
+    } while (res != 0 && errno == EINTR);
+    return res == 0;
+}
+
+static bool replaceFile(const std::string& from, const std::string& to) {
+    return ::rename(from.c_str(), to.c_str()) == 0;
+}
+
+// Makes the rename itself survive a crash
+static void syncDirectory(const std::string& path) {
+    const std::size_t slash = path.rfind('/');
+    const std::string dir = slash == std::string::npos ? std::string(".")
+                            : slash == 0 ? std::string("/")
+                                         : path.substr(0, slash);
+    int dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) return;
+    fsync(dirFd);
+    ::close(dirFd);
+}
+#endif
+
+bool AtomicFile::open(const std::string& path) {
+    discard();
+    this->path = path;
+    // Never reuses a file already there, which may be another save's
+    std::random_device seed;
+    std::mt19937 random(seed());
+    constexpr char HEX[] = "0123456789abcdef";
+    for (int attempt = 0; attempt < 16; attempt++) {
+        std::string name = path + ".";
+        for (int i = 0; i < 8; i++) name += HEX[random() & 0xF];
+        name += ".tmp";
+        if (!file.create(name)) {
+#ifndef _WIN32
+            if (errno != EEXIST) return false;
+#endif
+            continue;
+        }
+        tmpPath = std::move(name);
+        if (file.copyModeOf(path)) return true;
+        discard();
+        return false;
+    }
+    return false;
+}
+
+bool AtomicFile::commit() {
+    if (!file.isOpen()) return false;
+    bool ok = file.sync();
+    ok = file.close() && ok;
+    if (ok) ok = replaceFile(tmpPath, path);
+    if (!ok) {
+        discard();
+        return false;
+    }
+    tmpPath.clear();
+    syncDirectory(path);
+    return true;
+}
+
+void AtomicFile::discard() {
+    file.close();
+    if (tmpPath.empty()) return;
+    std::remove(tmpPath.c_str());
+    tmpPath.clear();
+}
@@ -0,0 +1,102 @@
+#include "EditHistory.hpp"
+
+#include <algorithm>
+
+void EditHistory::setBudget(std::size_t bytes) {
+    budget = bytes;
+    trim();
+}
+
+void EditHistory::begin() {
+    before.clear();
+    open = true;
+}
+
+void EditHistory::record(const struct MidiFile& file, u16 track) {
+    if (!open) return;
+    for (const std::pair<u16, EventStore>& t : before) {
+        if (t.first == track) return;
+    }
+    // Shares every chunk until the edits copy the ones they change
+    before.emplace_back(track, file.data[track].list);
+}
+
+void EditHistory::commit(const struct MidiFile& file) {
+    if (!open) return;
+    open = false;
+    if (before.empty()) return;
+
+    struct Step step;
+    std::sort(before.begin(), before.end(),
+              [](const std::pair<u16, EventStore>& a,
+                 const std::pair<u16, EventStore>& b) {
+                  return a.first < b.first;
+              });
+    for (const std::pair<u16, EventStore>& t : before) {
+        step.tracks.emplace_back(
+            t.first, file.data[t.first].list.versionOf(t.second));
+        step.bytes += step.tracks.back().second.bytes();
+    }
+    before.clear();
+
+    for (const struct Step& s : redoSteps) used -= s.bytes;
+    redoSteps.clear();
+    used += step.bytes;
+    undoSteps.push_back(std::move(step));
+    trim();
+}
+
+void EditHistory::swap(struct MidiFile& file, struct Step& step,
+                       std::vector<u16>& tracks) {
+    tracks.clear();
+    step.bytes = 0;
+    for (std::pair<u16, EventStore::Version>& t : step.tracks) {
+        file.data[t.first].list.restore(t.second);
+        step.bytes += t.second.bytes();
+        tracks.push_back(t.first);
+    }
+}
+
+bool EditHistory::undo(struct MidiFile& file, std::vector<u16>& tracks) {
+    if (open || undoSteps.empty()) return false;
+    struct Step step = std::move(undoSteps.back());
+    undoSteps.pop_back();
+    used -= step.bytes;
+    swap(file, step, tracks);
+    used += step.bytes;
+    redoSteps.push_back(std::move(step));
+    trim();
+    return true;
+}
+
+bool EditHistory::redo(struct MidiFile& file, std::vector<u16>& tracks) {
+    if (open || redoSteps.empty()) return false;
+    struct Step step = std::move(redoSteps.back());
+    redoSteps.pop_back();
+    used -= step.bytes;
+    swap(file, step, tracks);
+    used += step.bytes;
+    undoSteps.push_back(std::move(step));
+    trim();
+    return true;
+}
+
+void EditHistory::trim() {
+    // Redo steps go first, they are the least likely to be used
+    while (used > budget && !redoSteps.empty()) {
+        used -= redoSteps.front().bytes;
+        redoSteps.pop_front();
+    }
+    while (used > budget && undoSteps.size() > 1) {
+        used -= undoSteps.front().bytes;
+        undoSteps.pop_front();
+    }
+}
+
+void EditHistory::clear() {
+    undoSteps.clear();
+    redoSteps.clear();
+    before.clear();
+    open = false;
+    used = 0;
+}
@@ -0,0 +1,463 @@
+#include <atomic>
+#include <bit>
+
+#include "MidiFile.hpp"
+#include "MidiStatus.hpp"
+
+static std::atomic<u32> lastGeneration = 0;
+
+static u32 newGeneration() { return ++lastGeneration; }
+
+EventStore::EventStore(const EventStore& cpy) { *this = cpy; }
+
+EventStore& EventStore::operator=(const EventStore& cpy) {
+    if (this == &cpy) return *this;
+    chunks = cpy.chunks;
+    events = cpy.events;
+    origin = cpy.origin;
+    allocator = cpy.allocator;
+    edited = cpy.edited;
+    generation = cpy.generation;
+    chunksMoved();
+    return *this;
+}
+
+EventStore::EventStore(EventStore&& mov) { *this = std::move(mov); }
+
+EventStore& EventStore::operator=(EventStore&& mov) {
+    if (this == &mov) return *this;
+    chunks = std::move(mov.chunks);
+    events = mov.events;
+    origin = mov.origin;
+    allocator = std::move(mov.allocator);
+    edited = mov.edited;
+    generation = mov.generation;
+    chunksMoved();
+    mov.chunks.clear();
+    mov.events = 0;
+    mov.origin = 0;
+    mov.chunksMoved();
+    return *this;
+}
+
+void EventStore::reserve(std::size_t n) {
+    chunks.reserve((n + CHUNK_EVENTS - 1) / CHUNK_EVENTS);
+}
+
+void EventStore::clear() {
+    chunks.clear();
+    events = 0;
+    origin = 0;
+    countTree.clear();
+    spanTree.clear();
+    chunksMoved();
+    edited = false;
+    generation = newGeneration();
+}
+
+enum TrackEventType EventStore::type(std::size_t i) const {
+    return (enum TrackEventType)STATUS_TABLE[status(i)].kind;
+}
+
+void EventStore::Chunk::move(std::size_t to, std::size_t from,
+                             std::size_t n) {
+    std::memmove(deltas + to, deltas + from, n * sizeof(v_len));
+    std::memmove(statuses + to, statuses + from, n);
+    std::memmove(data0s + to, data0s + from, n);
+    std::memmove(data1s + to, data1s + from, n);
+    std::memmove(payloads + to, payloads + from, n * sizeof(Payload));
+}
+
+void EventStore::Chunk::append(const Chunk& other, std::size_t from,
+                               std::size_t n) {
+    std::memcpy(deltas + count, other.deltas + from, n * sizeof(v_len));
+    std::memcpy(statuses + count, other.statuses + from, n);
+    std::memcpy(data0s + count, other.data0s + from, n);
+    std::memcpy(data1s + count, other.data1s + from, n);
+    std::memcpy(payloads + count, other.payloads + from, n * sizeof(Payload));
+    count += n;
+}
+
+void EventStore::Chunk::computeTicks(std::size_t from) {
+    v_len time = from > 0 ? ticks[from - 1] : 0;
+    for (std::size_t k = from; k < count; k++) {
+        time += deltas[k];
+        ticks[k] = time;
+    }
+}
+
+// Indices of the trees are 1 based, node j sums the lowbit(j) chunks up to
+// chunk j - 1
+void EventStore::buildIndex() const {
+    const std::size_t n = chunks.size();
+    countTree.assign(n + 1, 0);
+    spanTree.assign(n + 1, 0);
+    for (std::size_t j = 1; j <= n; j++) {
+        countTree[j] += chunks[j - 1]->count;
+        spanTree[j] += chunks[j - 1]->span();
+        const std::size_t parent = j + (j & -j);
+        if (parent <= n) {
+            countTree[parent] += countTree[j];
+            spanTree[parent] += spanTree[j];
+        }
+    }
+    indexed = true;
+}
+
+void EventStore::seek(std::size_t i) const {
+    if (cacheEnd != 0 && i == cacheEnd && cacheChunk + 1 < chunks.size()) {
+        // Next chunk of a sequential pass
+        cacheTick += chunks[cacheChunk]->span();
+        cacheChunk++;
+        cacheFirst = cacheEnd;
+        cacheEnd += chunks[cacheChunk]->count;
+        return;
+    }
+    if (!indexed) buildIndex();
+    // Last chunk starting at or before event i
+    const std::size_t n = chunks.size();
+    std::size_t pos = 0, first = 0;
+    v_len tick = 0;
+    for (std::size_t step = std::bit_floor(n); step > 0; step >>= 1) {
+        if (pos + step <= n && first + countTree[pos + step] <= i) {
+            pos += step;
+            first += countTree[pos];
+            tick += spanTree[pos];
+        }
+    }
+    cacheChunk = pos;
+    cacheFirst = first;
+    cacheEnd = first + chunks[pos]->count;
+    cacheTick = tick;
+}
+
+void EventStore::chunkChanged(std::size_t c, std::ptrdiff_t count,
+                              v_len span) {
+    if (indexed) {
+        for (std::size_t j = c + 1; j < countTree.size(); j += j & -j) {
+            countTree[j] += count;
+            spanTree[j] += span;
+        }
+    }
+    if (cacheFirst == cacheEnd) {
+        // No chunk cached since the chunks last moved
+    } else if (c == cacheChunk) {
+        cacheEnd += count;
+    } else if (c < cacheChunk) {
+        cacheFirst += count;
+        cacheEnd += count;
+        cacheTick += span;
+    }
+}
+
+EventStore::Chunk& EventStore::appendSlot() {
+    if (chunks.empty() || chunks.back()->count == CHUNK_EVENTS) {
+        chunks.push_back(std::make_shared<Chunk>());
+        chunksMoved();
+    }
+    return writableChunk(chunks.size() - 1);
+}
+
+std::size_t EventStore::findTime(v_len tick) const {
+    if (events == 0 || tick <= origin) return 0;
+    const v_len target = tick - origin;
+    if (!indexed) buildIndex();
+    // Chunks that end before the tick are skipped whole
+    const std::size_t n = chunks.size();
+    std::size_t pos = 0, first = 0;
+    v_len start = 0;
+    for (std::size_t step = std::bit_floor(n); step > 0; step >>= 1) {
+        if (pos + step <= n && start + spanTree[pos + step] < target) {
+            pos += step;
+            start += spanTree[pos];
+            first += countTree[pos];
+        }
+    }
+    if (pos == n) return events;
+    const Chunk& chunk = *chunks[pos];
+    return first + (std::lower_bound(chunk.ticks, chunk.ticks + chunk.count,
+                                     target - start) -
+                    chunk.ticks);
+}
+
+u8 EventStore::storePayload(const u8* data, v_len length, Payload& res) {
+    if (length < INLINE_PAYLOAD) {
+        res = Payload{};
+        if (length > 0) std::memcpy(res.bytes, data, length);
+        return 0x80 | length;
+    }
+    u8 prefix[4];
+    u8 n = 0;
+    for (v_len v = length; n == 0 || v > 0; v >>= 7) prefix[n++] = v & 0x7F;
+
+    u8* record = allocator.allocate(n + length + 1, 1);
+    for (u8 j = 0; j < n; j++) {
+        record[j] = prefix[n - 1 - j] | (j + 1 < n ? 0x80 : 0);
+    }
+    std::memcpy(record + n, data, length);
+    record[n + length] = 0;
+    res.data = record;
+    return 0;
+}
+
+void EventStore::pushMessage(v_len delta, v_len time, u8 status, u8 data0,
+                             u8 data1) {
+    if (events == 0) origin = time - delta;
+    Chunk& chunk = appendSlot();
+    // The index is only rebuilt once the decoder is done
+    chunksMoved();
+    const std::size_t k = chunk.count++;
+    chunk.deltas[k] = delta;
+    chunk.ticks[k] = (k > 0 ? chunk.ticks[k - 1] : 0) + delta;
+    chunk.statuses[k] = status;
+    chunk.data0s[k] = data0;
+    chunk.data1s[k] = data1;
+    chunk.payloads[k] = Payload{};
+    events++;
+}
+
+void EventStore::pushPayload(v_len delta, v_len time, u8 status, u8 data0,
+                             const u8* record, v_len length) {
+    if (events == 0) origin = time - delta;
+    Chunk& chunk = appendSlot();
+    // The index is only rebuilt once the decoder is done
+    chunksMoved();
+    const std::size_t k = chunk.count++;
+    chunk.deltas[k] = delta;
+    chunk.ticks[k] = (k > 0 ? chunk.ticks[k - 1] : 0) + delta;
+    chunk.statuses[k] = status;
+    chunk.data0s[k] = data0;
+    chunk.payloads[k] = Payload{};
+    if (length < INLINE_PAYLOAD) {
+        const u8* data = record;
+        while (*data++ & 0x80);
+        chunk.data1s[k] = storePayload(data, length, chunk.payloads[k]);
+    } else {
+        chunk.data1s[k] = 0;
+        chunk.payloads[k].data = record;
+    }
+    events++;
+}
+
+struct TrackEvent EventStore::get(std::size_t i) const {
+    std::size_t k;
+    const Chunk& chunk = chunkAt(i, k);
+    const u8* statuses = chunk.statuses;
+    const u8* data0s = chunk.data0s;
+    const u8* data1s = chunk.data1s;
+    struct TrackEvent e;
+    e.deltaTime = chunk.deltas[k];
+    e.time = origin + cacheTick + chunk.ticks[k];
+    e.type = type(i);
+    switch (e.type) {
+        case MIDI:
+            e.midi.type = statuses[k] >> 4;
+            e.midi.channel = statuses[k] & 0xF;
+            e.midi.data0 = data0s[k];
+            e.midi.data1 = data1s[k];
+            break;
+        case SYSTEM_EVENT:
+            e.sys.type = statuses[k];
+            e.sys.data0 = data0s[k];
+            e.sys.data1 = data1s[k];
+            break;
+        case META:
+            e.meta = new MetaEvent(data0s[k]);
+            readMetaPayload(*e.meta, payloadData(i), payloadLength(i));
+            break;
+        case SYSEX_EVENT: {
+            const v_len length = payloadLength(i);
+            e.sysex = new SysExEvent(length);
+            e.sysex->type = statuses[k];
+            std::memcpy(e.sysex->data, payloadData(i), length);
+            e.sysex->data[length] = 0;
+        } break;
+        case UNKOWN:
+            break;
+    }
+    return e;
+}
+
+void EventStore::writeEvent(Chunk& chunk, std::size_t i,
+                            const struct TrackEvent& e) {
+    // e.time is ignored, the ticks follow the deltas
+    u8* statuses = chunk.statuses;
+    u8* data0s = chunk.data0s;
+    u8* data1s = chunk.data1s;
+    Payload* payloads = chunk.payloads;
+    chunk.deltas[i] = e.deltaTime;
+    data0s[i] = data1s[i] = 0;
+    payloads[i] = Payload{};
+    switch (e.type) {
+        case MIDI:
+            statuses[i] = (e.midi.type << 4) | e.midi.channel;
+            data0s[i] = e.midi.data0;
+            data1s[i] = e.midi.data1;
+            break;
+        case SYSTEM_EVENT:
+            statuses[i] = e.sys.type;
+            data0s[i] = e.sys.data0;
+            data1s[i] = e.sys.data1;
+            break;
+        case META: {
+            u8 buffer[8];
+            const u8* data = buffer;
+            v_len length = writeMetaPayload(*e.meta, buffer, data);
+            statuses[i] = 0xFF;
+            data0s[i] = e.meta->type;
+            data1s[i] = storePayload(data, length, payloads[i]);
+        } break;
+        case SYSEX_EVENT:
+            statuses[i] = e.sysex->type;
+            data1s[i] =
+                storePayload(e.sysex->data, e.sysex->length, payloads[i]);
+            break;
+        case UNKOWN:
+            statuses[i] = 0;
+            break;
+    }
+}
+
+void EventStore::set(std::size_t i, const struct TrackEvent& e) {
+    std::size_t k;
+    Chunk& chunk = chunkAt(i, k);
+    const std::size_t c = cacheChunk;
+    const v_len span = chunk.span();
+    writeEvent(chunk, k, e);
+    chunk.computeTicks(k);
+    chunkChanged(c, 0, chunk.span() - span);
+    edited = true;
+    generation = newGeneration();
+}
+
+void EventStore::setDeltaTime(std::size_t i, v_len delta) {
+    std::size_t k;
+    Chunk& chunk = chunkAt(i, k);
+    const std::size_t c = cacheChunk;
+    const v_len span = chunk.span();
+    chunk.deltas[k] = delta;
+    chunk.computeTicks(k);
+    chunkChanged(c, 0, chunk.span() - span);
+    edited = true;
+    generation = newGeneration();
+}
+
+void EventStore::insert(std::size_t i, const struct TrackEvent& e) {
+    std::size_t c, k;
+    if (i == events) {
+        // Appending never splits, the last chunk is only filled up
+        appendSlot();
+        c = chunks.size() - 1;
+        k = chunks[c]->count;
+    } else {
+        chunkAt(i, k);
+        c = cacheChunk;
+    }
+    if (chunks[c]->count == CHUNK_EVENTS) {
+        // Full, the second half moves to a new chunk
+        Chunk& full = *chunks[c];
+        std::shared_ptr<Chunk> next = std::make_shared<Chunk>();
+        const std::size_t half = CHUNK_EVENTS / 2;
+        next->append(full, half, full.count - half);
+        next->computeTicks(0);
+        full.count = half;
+        chunks.insert(chunks.begin() + c + 1, std::move(next));
+        chunksMoved();
+        if (k > half) {
+            c++;
+            k -= half;
+        }
+    }
+
+    Chunk& chunk = *chunks[c];
+    const v_len span = chunk.span();
+    chunk.move(k + 1, k, chunk.count - k);
+    chunk.count++;
+    writeEvent(chunk, k, e);
+    chunk.computeTicks(k);
+    chunkChanged(c, 1, chunk.span() - span);
+    events++;
+    edited = true;
+    generation = newGeneration();
+}
+
+void EventStore::push_back(const struct TrackEvent& e) { insert(size(), e); }
+
+void EventStore::erase(std::size_t i) {
+    std::size_t k;
+    Chunk& chunk = chunkAt(i, k);
+    const std::size_t c = cacheChunk;
+    const v_len span = chunk.span();
+    chunk.move(k, k + 1, chunk.count - k - 1);
+    chunk.count--;
+    chunk.computeTicks(k);
+    events--;
+    edited = true;
+    generation = newGeneration();
+
+    // Chunks that get too small are merged into a neighbour
+    if (chunk.count == 0) {
+        chunks.erase(chunks.begin() + c);
+        chunksMoved();
+    } else if (chunk.count < CHUNK_EVENTS / 4 && c > 0 &&
+               chunks[c - 1]->count + chunk.count <= CHUNK_EVENTS) {
+        Chunk& prev = writableChunk(c - 1);
+        const std::size_t from = prev.count;
+        prev.append(chunk, 0, chunk.count);
+        prev.computeTicks(from);
+        chunks.erase(chunks.begin() + c);
+        chunksMoved();
+    } else if (chunk.count < CHUNK_EVENTS / 4 && c + 1 < chunks.size() &&
+               chunks[c + 1]->count + chunk.count <= CHUNK_EVENTS) {
+        const std::size_t from = chunk.count;
+        chunk.append(*chunks[c + 1], 0, chunks[c + 1]->count);
+        chunk.computeTicks(from);
+        chunks.erase(chunks.begin() + c + 1);
+        chunksMoved();
+    } else {
+        chunkChanged(c, -1, chunk.span() - span);
+    }
+}
+
+std::size_t EventStore::Version::bytes() const {
+    return sizeof(Version) +
+           chunks.size() * (sizeof(std::shared_ptr<Chunk>) + sizeof(Chunk));
+}
+
+struct EventStore::Version EventStore::versionOf(
+    const EventStore& older) const {
+    struct Version res;
+    const std::size_t n = std::min(chunks.size(), older.chunks.size());
+    while (res.prefix < n &&
+           chunks[res.prefix] == older.chunks[res.prefix])
+        res.prefix++;
+    while (res.prefix + res.suffix < n &&
+           chunks[chunks.size() - 1 - res.suffix] ==
+               older.chunks[older.chunks.size() - 1 - res.suffix])
+        res.suffix++;
+    res.chunks.assign(older.chunks.begin() + res.prefix,
+                      older.chunks.end() - res.suffix);
+    res.events = older.events;
+    res.origin = older.origin;
+    res.edited = older.edited;
+    res.generation = older.generation;
+    return res;
+}
+
+void EventStore::restore(struct Version& version) {
+    // The chunks in between are swapped, the shared ones did not move
+    std::vector<std::shared_ptr<Chunk>> middle(
+        std::make_move_iterator(chunks.begin() + version.prefix),
+        std::make_move_iterator(chunks.end() - version.suffix));
+    chunks.erase(chunks.begin() + version.prefix,
+                 chunks.end() - version.suffix);
+    chunks.insert(chunks.begin() + version.prefix,
+                  std::make_move_iterator(version.chunks.begin()),
+                  std::make_move_iterator(version.chunks.end()));
+    version.chunks = std::move(middle);
+    std::swap(events, version.events);
+    std::swap(origin, version.origin);
+    std::swap(edited, version.edited);
+    std::swap(generation, version.generation);
+    chunksMoved();
+}
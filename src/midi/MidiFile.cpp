@@ -1,28 +1,36 @@
 #include "MidiFile.hpp"
 
+#include <algorithm>
 #include <cstddef>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
 
+#include "MidiScan.hpp"
+#include "MidiStatus.hpp"
+#include "OutputFile.hpp"
+#include "ThreadPool.hpp"
+
 #pragma region UTILS
 const v_len V_LEN_ERROR = -1;
 
-v_len readVarLen(u8*& data, u8* end) {
-    u8* ptr = data;
+v_len readVarLen(const u8*& data, const u8* end) {
+    const u8* ptr = data;
+    if (ptr >= end) return V_LEN_ERROR;
     v_len result = (*ptr) & 0x7f;
     while (((*ptr) & 0x80) != 0) {
         ptr++;
+        // At most 4 bytes
+        if (ptr >= end || ptr - data >= 4) return V_LEN_ERROR;
         result <<= 7;
         result += (*ptr) & 0x7f;
-        if (ptr > end) return V_LEN_ERROR;
     }
     ptr++;
     data = ptr;
     return result;
 }
 
-bool matchesHeader(u8* data, const char* content) {
+bool matchesHeader(const u8* data, const char* content) {
     return data[0] == content[0] && data[1] == content[1] &&
            data[2] == content[2] && data[3] == content[3];
 }
@@ -30,7 +38,7 @@ bool matchesHeader(u8* data, const char* content) {
 
 #pragma region READ
 // Does not handle the allocation of the result
-enum MidiError readMidiTrackHeader(u8* data, u8* end,
+enum MidiError readMidiTrackHeader(const u8* data, const u8* end,
                                    struct MidiTrack& result) {
     if (data + SZ_TRACK_HEADER > end) {
         DEBG_PRINT("EOF !");
@@ -51,275 +59,527 @@ enum MidiError readMidiTrackHeader(u8* data, u8* end,
     return NONE;
 }
 
+// data points to the byte before the n bytes that must remain
 #define CHECK_DATA_REMAINS(n) \
-    if (data + n > end) return INVALID_EVENT;
-#define CHECK_DATA_REMAINS_META(n) \
-    if (data + n > end) {          \
-        delete e.meta;             \
-        return INVALID_EVENT;      \
-    }
-
-// TODO parallelize this
-enum MidiError decodeMidiMessage(u8*& readData, u8* end, struct TrackEvent& e,
-                                 u8 currentEventType, u8& prevEventType) {
-    u8* data = readData;
-    const u8 b = currentEventType;
-    const u8 t1 = b >> 4;
-    if (t1 >= NOTE_OFF && t1 <= PITCH_WHEEL) {
-        e.type = MIDI;
-        e.midi.channel = b & 0xF;
-        e.midi.type = t1;
-        switch (t1) {
-            case NOTE_OFF:
-            case NOTE_ON:
-            case POLY_AFTERTOUCH:
-            case CC:
-            case PITCH_WHEEL:
-                CHECK_DATA_REMAINS(2);
-                e.midi.data0 = data[1];
-                e.midi.data1 = data[2];
-                data += 2;
-                break;
-            case PROGRAM_CHANGE:
-            case AFTERTOUCH:
-                CHECK_DATA_REMAINS(1);
-                e.midi.data0 = data[1];
-                data++;
-                break;
-        }
-    } else if (b < TIMING_CLOCK && b > SYSEX) {
-        e.type = SYSTEM_EVENT;
-        e.sys.type = b;
-        switch (b) {
-            case UND0:
-            case UND1:
-            case UND2:
-            case TUNE:
-                break;
-            case SONG_POSITION:
-                CHECK_DATA_REMAINS(2);
-                e.sys.data0 = data[1];
-                e.sys.data1 = data[2];
-                data += 2;
-                break;
-            case SONG_SELECT:
-                CHECK_DATA_REMAINS(1);
-                e.sys.data0 = data[1];
-                data++;
-                break;
-            case SYSEX_END:
-                CHECK_DATA_REMAINS(2);
-                data++;
-                e.meta = new MetaEvent(SYSEX_END);
-                e.meta->length = readVarLen(data, end);
-                e.meta->data = new u8[e.meta->length + 1];
-                CHECK_DATA_REMAINS_META(e.meta->length);
-                std::memcpy(e.meta->data, data, e.meta->length);
-                e.meta->data[e.meta->length] = 0;
-                data += 1 + data[1];
-                break;
-        }
-    } else if (b == 0xFF && data + 1 < end && data[1] < 0x80) {
-        e.type = META;
-        data++;
-        e.meta = new MetaEvent(data[0]);
-        switch (data[0]) {
-            case SEQUENCE_NUMBER:
-                if (data[1] == 2) {
-                    CHECK_DATA_REMAINS_META(4);
-                    e.meta->seqNumber = (data[2] << 8) + data[3];
-                    data += 4;
-                } else {
-                    e.meta->seqNumber = 0;
-                    data++;
-                }
-                break;
-            case END_OF_TRACK:
-                data++;
-                break;
-            default:
-            case TEXT:
-            case COPYRIGHT:
-            case NAME:
-            case INSTRUMENT_NAME:
-            case LYRIC:
-            case MARKER:
-            case CUE:
-            case SPECIFIC:
-            case DEVICE_NAME:
-                CHECK_DATA_REMAINS_META(1);
-                data++;
-                e.meta->length = readVarLen(data, end);
-                CHECK_DATA_REMAINS_META(e.meta->length);
-                e.meta->data = new u8[e.meta->length + 1];
-                std::memcpy(e.meta->data, data, e.meta->length);
-                e.meta->data[e.meta->length] = 0;
-                data--;
-                data += e.meta->length;
-                break;
-            case MIDI_CHANNEL_PREFIX:
-                CHECK_DATA_REMAINS_META(2);
-                e.meta->channel = data[2];
-                data += 2;
-                break;
-            case SET_TEMPO:
-                CHECK_DATA_REMAINS_META(4);
-                e.meta->MPQ = READ_BIG_ENDIAN_U24((data + 2));
-                data += 4;
-                break;
-            case SMPTE_OFFSET:
-                CHECK_DATA_REMAINS_META(6);
-                e.meta->startTime.hours = data[2];
-                e.meta->startTime.minutes = data[3];
-                e.meta->startTime.seconds = data[4];
-                e.meta->startTime.frames = data[5];
-                e.meta->startTime.frameFractions = data[6];
-                data += 6;
-                break;
-            case TIME_SIGNATURE:
-                CHECK_DATA_REMAINS_META(5);
-                e.meta->timeSignature.numerator = data[2];
-                e.meta->timeSignature.denominator = data[3];
-                e.meta->timeSignature.TPM = data[4];
-                e.meta->timeSignature.noteDivision = data[5];
-                data += 5;
-                break;
-            case KEY_SIGNATURE:
-                CHECK_DATA_REMAINS_META(3);
-                e.meta->key.sharps = data[2];
-                e.meta->key.minor = data[3];
-                data += 3;
-                break;
+    if (data + n >= end) return INVALID_EVENT;
+
+// Reads the length of a meta or sysex payload, leaves data at its first byte
+inline enum MidiError readPayloadLength(const u8*& data, const u8* end,
+                                        v_len& length) {
+    length = readVarLen(data, end);
+    if (length == V_LEN_ERROR) return V_LEN_INVALID;
+    if (length > (std::size_t)(end - data)) return INVALID_EVENT;
+    return NONE;
+}
+
+// Minimum payload length of meta events with fixed fields
+inline v_len getMetaMinLength(u8 type) {
+    switch (type) {
+        case MIDI_CHANNEL_PREFIX:
+            return 1;
+        case SET_TEMPO:
+            return 3;
+        case SMPTE_OFFSET:
+            return 5;
+        case TIME_SIGNATURE:
+            return 4;
+        case KEY_SIGNATURE:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+void readMetaPayload(struct MetaEvent& meta, const u8* data, v_len length) {
+    switch (meta.type) {
+        case SEQUENCE_NUMBER:
+            meta.seqNumber = (length >= 2) ? (data[0] << 8) + data[1] : 0;
+            break;
+        case END_OF_TRACK:
+            break;
+        case MIDI_CHANNEL_PREFIX:
+            meta.channel = data[0];
+            break;
+        case SET_TEMPO:
+            meta.MPQ = READ_BIG_ENDIAN_U24(data);
+            break;
+        case SMPTE_OFFSET:
+            meta.startTime.hours = data[0];
+            meta.startTime.minutes = data[1];
+            meta.startTime.seconds = data[2];
+            meta.startTime.frames = data[3];
+            meta.startTime.frameFractions = data[4];
+            break;
+        case TIME_SIGNATURE:
+            meta.timeSignature.numerator = data[0];
+            meta.timeSignature.denominator = data[1];
+            meta.timeSignature.TPM = data[2];
+            meta.timeSignature.noteDivision = data[3];
+            break;
+        case KEY_SIGNATURE:
+            meta.key.sharps = data[0];
+            meta.key.minor = data[1];
+            break;
+        default:
+        case TEXT:
+        case COPYRIGHT:
+        case NAME:
+        case INSTRUMENT_NAME:
+        case LYRIC:
+        case MARKER:
+        case CUE:
+        case SPECIFIC:
+        case DEVICE_NAME:
+            meta.length = length;
+            meta.data = new u8[length + 1];
+            std::memcpy(meta.data, data, length);
+            meta.data[length] = 0;
+            break;
+    }
+}
+
+v_len writeMetaPayload(const struct MetaEvent& meta, u8* buffer,
+                       const u8*& data) {
+    data = buffer;
+    switch (meta.type) {
+        case SEQUENCE_NUMBER:
+            buffer[0] = meta.seqNumber >> 8;
+            buffer[1] = meta.seqNumber;
+            return 2;
+        case END_OF_TRACK:
+            return 0;
+        case MIDI_CHANNEL_PREFIX:
+            buffer[0] = meta.channel;
+            return 1;
+        case SET_TEMPO:
+            buffer[0] = meta.MPQ >> 16;
+            buffer[1] = meta.MPQ >> 8;
+            buffer[2] = meta.MPQ;
+            return 3;
+        case SMPTE_OFFSET:
+            buffer[0] = meta.startTime.hours;
+            buffer[1] = meta.startTime.minutes;
+            buffer[2] = meta.startTime.seconds;
+            buffer[3] = meta.startTime.frames;
+            buffer[4] = meta.startTime.frameFractions;
+            return 5;
+        case TIME_SIGNATURE:
+            buffer[0] = meta.timeSignature.numerator;
+            buffer[1] = meta.timeSignature.denominator;
+            buffer[2] = meta.timeSignature.TPM;
+            buffer[3] = meta.timeSignature.noteDivision;
+            return 4;
+        case KEY_SIGNATURE:
+            buffer[0] = meta.key.sharps;
+            buffer[1] = meta.key.minor;
+            return 2;
+        default:
+            data = meta.data;
+            return meta.length;
+    }
+}
+
+// Meta and sysex payloads are kept raw in the source bytes, only their size is
+// checked here
+enum MidiError decodePayloadEvent(const u8*& readData, const u8* end,
+                                  EventStore& res, v_len delta, v_len time) {
+    const u8 b = *readData;
+    const u8* data = readData + 1;
+    u8 type = 0;
+    if (b == 0xFF) type = *data++;
+
+    const u8* record = data;
+    v_len length;
+    enum MidiError err = readPayloadLength(data, end, length);
+    if (err != NONE) return err;
+    if (b == 0xFF && length < getMetaMinLength(type)) return INVALID_EVENT;
+
+    res.pushPayload(delta, time, b, type, record, length);
+    // Leave the pointer on the last byte of the event
+    readData = data + length - 1;
+    return NONE;
+}
+
+// Slow path for system, meta and sysex events, channel messages are decoded
+// inline by decodeMidiMessages
+enum MidiError decodeMidiMessage(const u8*& readData, const u8* end,
+                                 EventStore& res, v_len delta, v_len time) {
+    const u8* data = readData;
+    const u8 b = *data;
+    if (STATUS_TABLE[b].flags & STATUS_PAYLOAD) {
+        if (b == 0xFF && (data + 1 >= end || data[1] >= 0x80))
+            return INVALID_EVENT;
+        return decodePayloadEvent(readData, end, res, delta, time);
+    }
+    switch (STATUS_TABLE[b].length) {
+        case 2:
+            CHECK_DATA_REMAINS(2);
+            res.pushMessage(delta, time, b, data[1], data[2]);
+            break;
+        case 1:
+            CHECK_DATA_REMAINS(1);
+            res.pushMessage(delta, time, b, data[1], 0);
+            break;
+        default:
+            res.pushMessage(delta, time, b, 0, 0);
+            break;
+    }
+    readData = data + STATUS_TABLE[b].length;
+    return NONE;
+}
+
+struct TempoEvent {
+    u32 MPB;
+    u16 track;
+};
+
+struct SignatureEvent {
+    struct TimeSignature signature;
+    u16 track;
+};
+
+// Tempo and time signature events of a track, in track order
+struct TimeMapEvents {
+    std::vector<std::pair<v_len, TempoEvent>> tempos;
+    std::vector<std::pair<v_len, SignatureEvent>> signatures;
+    // Track the events being added come from
+    u16 track = 0;
+};
+
+inline void addTimeMapEvent(struct TimeMapEvents& res, v_len time, u8 type,
+                            const u8* data) {
+    if (type == SET_TEMPO) {
+        res.tempos.emplace_back(
+            time, TempoEvent{(u32)READ_BIG_ENDIAN_U24(data), res.track});
+    } else if (type == TIME_SIGNATURE) {
+        res.signatures.emplace_back(
+            time, SignatureEvent{TimeSignature{.numerator = data[0],
+                                               .denominator = data[1],
+                                               .TPM = data[2],
+                                               .noteDivision = data[3]},
+                                 res.track});
+    }
+}
+
+// Walks the structure of the track without decoding anything, must accept
+// exactly what decodeMidiMessages accepts
+// Stops after limit events, ticks are only followed when Timed
+// With an index, a checkpoint is added every TRACK_INDEX_INTERVAL events
+// Tempo and time signature changes are collected in timeMaps if given
+template <bool Timed>
+enum MidiError walkMidiMessages(const u8* begin, const u8* end,
+                                struct TrackCursor& cursor, u32 limit,
+                                u32& count,
+                                std::vector<struct TrackCursor>* index,
+                                struct TimeMapEvents* timeMaps = nullptr) {
+    const u8* data = begin + cursor.offset;
+    u8 running = cursor.running;
+    v_len time = cursor.time;
+    v_len length;
+    count = 0;
+    while (data < end && count < limit) {
+        if (index != nullptr && count % TRACK_INDEX_INTERVAL == 0) {
+            index->push_back(
+                TrackCursor{(u32)(data - begin), time, running});
         }
-    } else if (b == SYSEX) {
-        e.type = SYSEX_EVENT;
-        CHECK_DATA_REMAINS(1);
-        e.sysex = new SysExEvent();
-        data++;
-        {
-            v_len len;
-            for (len = 0; data + len < end; len++) {
-                if ((data[len] >> 7) == 1) break;
+        if (running != 0 && data + 1 < end && data[1] < 0x80) {
+            // Run of events with one byte deltas and running status
+            const std::size_t sz = 1 + STATUS_TABLE[running].length;
+            std::size_t n = countDataBytes(data, end) / sz;
+            n = std::min<std::size_t>(n, limit - count);
+            if (index != nullptr) {
+                n = std::min<std::size_t>(
+                    n, TRACK_INDEX_INTERVAL - count % TRACK_INDEX_INTERVAL);
             }
-            if (data + len >= end) {
-                delete e.sysex;
-                return INVALID_EVENT;
+            if (Timed) {
+                for (std::size_t i = 0; i < n; i++) time += data[i * sz];
             }
-            e.sysex->length = len;
-            e.sysex->data = new u8[len + 1];
-            std::memcpy(e.sysex->data, data + 1, len);
-            e.sysex->data[len] = 0;
+            count += n;
+            data += n * sz;
+            if (n > 0) continue;
         }
-        data += 2 + data[1];
-    } else {
-        // Running status
-        if (prevEventType == 0) return INVALID_EVENT;
-        readData = data - 1;
-        return decodeMidiMessage(readData, end, e, prevEventType,
-                                 prevEventType);
-    }
-    prevEventType = b;
-    readData = data;
+        const v_len delta = readVarLen(data, end);
+        if (delta == V_LEN_ERROR) return V_LEN_INVALID;
+        if (data >= end) return INVALID_EVENT;
+        if (Timed) time += delta;
+
+        const u8 b = *data;
+        if (b < 0x80) {
+            // Running status, data is already on the first data byte
+            if (running == 0) return INVALID_EVENT;
+            data += STATUS_TABLE[running].length;
+        } else if (STATUS_TABLE[b].flags & STATUS_RUNNING) {
+            running = b;
+            data += 1 + STATUS_TABLE[b].length;
+        } else if (b == 0xFF) {
+            if (data + 1 >= end || data[1] >= 0x80) return INVALID_EVENT;
+            const u8 type = data[1];
+            data += 2;
+            enum MidiError err = readPayloadLength(data, end, length);
+            if (err != NONE) return err;
+            if (length < getMetaMinLength(type)) return INVALID_EVENT;
+            if (Timed && timeMaps != nullptr)
+                addTimeMapEvent(*timeMaps, time, type, data);
+            data += length;
+        } else if (b == SYSEX || b == SYSEX_END) {
+            data++;
+            enum MidiError err = readPayloadLength(data, end, length);
+            if (err != NONE) return err;
+            data += length;
+        } else {
+            data += 1 + STATUS_TABLE[b].length;
+        }
+        if (data > end) return INVALID_EVENT;
+        count++;
+    }
+    cursor.offset = data - begin;
+    cursor.time = time;
+    cursor.running = running;
     return NONE;
 }
 
-enum MidiError decodeMidiMessage(u8*& readData, u8* end, struct TrackEvent& e,
-                                 u8& prevEventType) {
-    return decodeMidiMessage(readData, end, e, *readData, prevEventType);
+enum MidiError countMidiMessages(const u8* data, const u8* end, u32& count) {
+    struct TrackCursor cursor = {};
+    return walkMidiMessages<false>(data, end, cursor, UINT32_MAX, count,
+                                   nullptr);
 }
-#include <cstring>
 
-enum MidiError decodeMidiMessages(u8* data, u8* end,
-                                  std::vector<TrackEvent>& res) {
-    u32 listSz = (u32)((end - data) / 3.5f);
-    res.resize(listSz);
-    u32 event = 0;
-    u8 prevB = 0;
-    u32 time = 0;
-    while (data < end) {
-        struct TrackEvent& e = res[event];
-        e.deltaTime = readVarLen(data, end);
-        e.time = (time += e.deltaTime);
-        if (e.deltaTime == V_LEN_ERROR) {
+// Decodes at most limit events from the cursor, which is left after the last
+// one
+enum MidiError decodeMidiMessages(const u8* begin, const u8* end,
+                                  struct TrackCursor& cursor, u32 limit,
+                                  EventStore& res) {
+    const u8* data = begin + cursor.offset;
+    u8 prevB = cursor.running;
+    v_len time = cursor.time;
+    enum MidiError err = NONE;
+    while (data < end && limit > 0) {
+        if (prevB != 0 && data + 1 < end && data[1] < 0x80) {
+            // Run of events with one byte deltas and running status, all
+            // the bytes of the run are known to be data bytes
+            const u8 len = STATUS_TABLE[prevB].length;
+            const std::size_t n = std::min<std::size_t>(
+                countDataBytes(data, end) / (1 + len), limit);
+            for (std::size_t i = 0; i < n; i++) {
+                res.pushMessage(data[0], time += data[0], prevB, data[1],
+                                len == 2 ? data[2] : 0);
+                data += 1 + len;
+            }
+            limit -= n;
+            if (n > 0) continue;
+        }
+        const v_len delta = readVarLen(data, end);
+        if (delta == V_LEN_ERROR) {
             return V_LEN_INVALID;
         }
+        time += delta;
+        if (data >= end) return INVALID_EVENT;
+        limit--;
 
-        enum MidiError err = decodeMidiMessage(data, end, e, prevB);
+        // Channel messages, with or without running status
+        u8 status = *data;
+        const u8* bytes = data + 1;
+        if (status < 0x80) {
+            if (prevB == 0) return INVALID_EVENT;
+            status = prevB;
+            bytes = data;
+        }
+        if (STATUS_TABLE[status].flags & STATUS_RUNNING) {
+            const u8 len = STATUS_TABLE[status].length;
+            if (bytes + len > end) return INVALID_EVENT;
+            res.pushMessage(delta, time, status, bytes[0],
+                            len == 2 ? bytes[1] : 0);
+            prevB = status;
+            data = bytes + len;
+            continue;
+        }
+
+        err = decodeMidiMessage(data, end, res, delta, time);
         if (err != NONE) {
             return err;
         }
 
         data++;
-        event++;
-        if (event >= listSz) {
-            listSz <<= 1;
-            res.resize(listSz);
-        }
     }
-    res.resize(event);
+    cursor.offset = data - begin;
+    cursor.time = time;
+    cursor.running = prevB;
     return NONE;
 }
 
-void computeTimes(std::vector<TrackEvent>& res) {
-    v_len time = 0;
-    for (TrackEvent& e : res) {
-        time += e.deltaTime;
-        e.time = time;
-    }
-}
-
-// TODO reorder the result so we don't get owned by nonstandard files
-void computeTimeMapsForTrack(struct MidiFile& file, struct MidiTrack& track) {
-    for (const TrackEvent& e : track.list) {
-        if (e.type == META) {
-            if (e.meta->type == TIME_SIGNATURE) {
-                TimeSignatureChange res{
-                    .time = e.time,
-                    .bar = getBar(file.timeSignatureInfo, e.time).bar,
-                    .signature = e.meta->timeSignature};
-                file.timeSignatureInfo.emplace_back(res);
-            } else if (e.meta->type == SET_TEMPO) {
-                TempoChange res{
-                    .time = e.time,
-                    .timeMicros = getTimeMicros(file.timingInfo, e.time),
-                    .microsPerTick =
-                        getMicrosPerTick(file.division, e.meta->MPQ)};
-                file.timingInfo.emplace_back(res);
-            }
-        }
+void collectTimeMapEvents(const struct MidiTrack& track,
+                          struct TimeMapEvents& res) {
+    if (!track.decoded) {
+        // Straight from the raw bytes, which were checked when indexing
+        struct TrackCursor cursor = {};
+        u32 count;
+        walkMidiMessages<true>(track.data, track.data + track.length, cursor,
+                               UINT32_MAX, count, nullptr, &res);
+        return;
     }
-    if (file.timingInfo.empty()) {
+    const EventStore& list = track.list;
+    for (std::size_t i = 0; i < list.size(); i++) {
+        if (list.status(i) != 0xFF) continue;
+        addTimeMapEvent(res, list.time(i), list.data0(i), list.payloadData(i));
+    }
+}
+
+// Changes are ordered by tick then by track so the result does not depend on
+// the order tracks were decoded in
+template <typename T>
+void sortTimeMapEvents(std::vector<std::pair<v_len, T>>& events) {
+    std::stable_sort(events.begin(), events.end(),
+                     [](const std::pair<v_len, T>& a,
+                        const std::pair<v_len, T>& b) {
+                         return a.first < b.first;
+                     });
+}
+
+void buildTimingMap(struct MidiFile& file,
+                    std::vector<std::pair<v_len, TempoEvent>>& tempos) {
+    sortTimeMapEvents(tempos);
+    file.timingInfo.clear();
+    file.timeMapsVersion++;
+    if (tempos.empty() || tempos[0].first != 0) {
         // default 120 bpm
         file.timingInfo.emplace_back(TempoChange{
             .time = 0,
             .timeMicros = 0,
             .microsPerTick = getMicrosPerTick(file.division, 500000)});
     }
-    if (file.timeSignatureInfo.empty()) {
-        // default 4/4
-        file.timeSignatureInfo.emplace_back(TimeSignatureChange{
-            .time = 0,
-            .bar = 0,
-            .signature = TimeSignature{.numerator = 4,
-                                       .denominator = 2,  // 2^2 = 4
-                                       .TPM = 24,
-                                       .noteDivision = 8}});
+    for (const std::pair<v_len, TempoEvent>& tempo : tempos) {
+        TempoChange res{
+            .time = tempo.first,
+            .timeMicros = file.timingInfo.empty()
+                              ? 0
+                              : getTimeMicros(file.timingInfo.back(),
+                                              tempo.first),
+            .microsPerTick = getMicrosPerTick(file.division, tempo.second.MPB),
+            .track = tempo.second.track};
+        file.timingInfo.emplace_back(res);
     }
 }
 
-void computeTimeSignatureMapForTrack(struct MidiFile& file,
-                                     struct MidiTrack& track) {
-    for (const TrackEvent& e : track.list) {
-        if (e.type == META && e.meta->type == TIME_SIGNATURE) {
-            TimeSignatureChange res{
-                .time = e.time,
-                .bar = getBar(file.timeSignatureInfo, e.time).bar,
-                .signature = e.meta->timeSignature};
-            file.timeSignatureInfo.emplace_back(res);
+// Same computation as buildTimingMap, for the changes from index first on
+static void retimeTimingMap(struct MidiFile& file, std::size_t first) {
+    std::vector<TempoChange>& tempos = file.timingInfo;
+    file.timeMapsVersion++;
+    if (first == 0 && !tempos.empty()) tempos[first++].timeMicros = 0;
+    for (std::size_t i = first; i < tempos.size(); i++) {
+        tempos[i].timeMicros = getTimeMicros(tempos[i - 1], tempos[i].time);
+    }
+}
+
+// Index in timingInfo of the tempo change made by an event of a track, or
+// where it goes if it is not in yet
+static std::size_t findTempoChange(const struct MidiFile& file, u16 track,
+                                   std::size_t event) {
+    const EventStore& list = file.data[track].list;
+    const v_len time = list.time(event);
+    // Changes of a track at the same tick keep the order of their events
+    std::size_t rank = 0;
+    for (std::size_t i = event; i > 0 && list.time(i - 1) == time; i--) {
+        if (list.isMeta(i - 1, SET_TEMPO)) rank++;
+    }
+    std::vector<TempoChange>::const_iterator it = std::lower_bound(
+        file.timingInfo.cbegin(), file.timingInfo.cend(), time,
+        [track](const TempoChange& c, v_len t) {
+            return c.time < t || (c.time == t && c.track < track);
+        });
+    return it - file.timingInfo.cbegin() + rank;
+}
+
+// Whether a tempo change of the track is at or after the tick
+static bool hasTempoChangeFrom(const struct MidiFile& file, u16 track,
+                               v_len tick) {
+    std::vector<TempoChange>::const_iterator it = std::lower_bound(
+        file.timingInfo.cbegin(), file.timingInfo.cend(), tick,
+        [](const TempoChange& c, v_len tick) { return c.time < tick; });
+    for (; it != file.timingInfo.cend(); it++) {
+        if (it->track == track) return true;
+    }
+    return false;
+}
+
+bool updateTimingMapOnInsert(struct MidiFile& file, u16 track,
+                             std::size_t event) {
+    const EventStore& list = file.data[track].list;
+    const v_len delta = list.deltaTime(event);
+    // Later events of the track moved by delta ticks
+    if (delta != 0 && hasTempoChangeFrom(file, track, list.time(event) - delta))
+        return false;
+    if (!list.isMeta(event, SET_TEMPO)) return true;
+
+    std::vector<TempoChange>& tempos = file.timingInfo;
+    const v_len time = list.time(event);
+    if (time == 0 && !tempos.empty() &&
+        tempos[0].track == DEFAULT_MAP_TRACK) {
+        tempos.erase(tempos.begin());
+    }
+    const std::size_t i = findTempoChange(file, track, event);
+    tempos.insert(tempos.begin() + i,
+                  TempoChange{.time = time,
+                              .timeMicros = 0,
+                              .microsPerTick = getMicrosPerTick(
+                                  file.division,
+                                  READ_BIG_ENDIAN_U24(list.payloadData(event))),
+                              .track = track});
+    retimeTimingMap(file, i);
+    return true;
+}
+
+bool updateTimingMapOnErase(struct MidiFile& file, u16 track,
+                            std::size_t event) {
+    const EventStore& list = file.data[track].list;
+    const bool tempo = list.isMeta(event, SET_TEMPO);
+    if (list.deltaTime(event) != 0) {
+        // Later events of the track will move back by its delta
+        std::size_t self = tempo ? findTempoChange(file, track, event) : 0;
+        for (std::size_t i = self + tempo; i < file.timingInfo.size(); i++) {
+            if (file.timingInfo[i].time >= list.time(event) &&
+                file.timingInfo[i].track == track)
+                return false;
         }
     }
+    if (!tempo) return true;
+
+    std::vector<TempoChange>& tempos = file.timingInfo;
+    std::size_t i = findTempoChange(file, track, event);
+    tempos.erase(tempos.begin() + i);
+    if (tempos.empty() || tempos[0].time != 0) {
+        // default 120 bpm
+        tempos.insert(tempos.begin(),
+                      TempoChange{.time = 0,
+                                  .timeMicros = 0,
+                                  .microsPerTick =
+                                      getMicrosPerTick(file.division, 500000)});
+        i = 0;
+    }
+    retimeTimingMap(file, i);
+    return true;
+}
+
+bool updateTimingMapOnSet(struct MidiFile& file, u16 track,
+                          std::size_t event) {
+    const EventStore& list = file.data[track].list;
+    if (!list.isMeta(event, SET_TEMPO)) return true;
+    const std::size_t i = findTempoChange(file, track, event);
+    if (i >= file.timingInfo.size() || file.timingInfo[i].track != track)
+        return false;
+    file.timingInfo[i].microsPerTick = getMicrosPerTick(
+        file.division, READ_BIG_ENDIAN_U24(list.payloadData(event)));
+    // Its own start does not depend on its tempo
+    retimeTimingMap(file, i + 1);
+    return true;
+}
 
-    if (file.timeSignatureInfo.empty()) {
+void buildTimeSignatureMap(
+    struct MidiFile& file,
+    std::vector<std::pair<v_len, SignatureEvent>>& signatures) {
+    sortTimeMapEvents(signatures);
+    file.timeSignatureInfo.clear();
+    file.timeMapsVersion++;
+    if (signatures.empty() || signatures[0].first != 0) {
         // default 4/4
         file.timeSignatureInfo.emplace_back(TimeSignatureChange{
             .time = 0,
@@ -329,44 +589,402 @@ void computeTimeSignatureMapForTrack(struct MidiFile& file,
                                        .TPM = 24,
                                        .noteDivision = 8}});
     }
+    for (const std::pair<v_len, SignatureEvent>& sig : signatures) {
+        TimeSignatureChange res{
+            .time = sig.first,
+            .bar = file.timeSignatureInfo.empty()
+                       ? (u32)0
+                       : getBar(file.timeSignatureInfo, sig.first).bar,
+            .signature = sig.second.signature,
+            .track = sig.second.track};
+        file.timeSignatureInfo.emplace_back(res);
+    }
 }
 
-void computeTimingMapForTrack(struct MidiFile& file, struct MidiTrack& track) {
-    for (const TrackEvent& e : track.list) {
-        if (e.type == META && e.meta->type == SET_TEMPO) {
-            TempoChange res{
-                .time = e.time,
-                .timeMicros = getTimeMicros(file.timingInfo, e.time),
-                .microsPerTick = getMicrosPerTick(file.division, e.meta->MPQ)};
-            file.timingInfo.emplace_back(res);
-        }
+// Same computation as buildTimeSignatureMap, for the whole map
+static void rebarTimeSignatureMap(struct MidiFile& file) {
+    std::vector<TimeSignatureChange>& signatures = file.timeSignatureInfo;
+    file.timeMapsVersion++;
+    if (!signatures.empty()) signatures[0].bar = 0;
+    for (std::size_t i = 1; i < signatures.size(); i++) {
+        signatures[i].bar = getBar(signatures[i - 1], signatures[i].time).bar;
     }
-    if (file.timingInfo.empty()) {
-        // default 120 bpm
-        file.timingInfo.emplace_back(TempoChange{
-            .time = 0,
+}
+
+// Replaces the changes of the tracks marked in changed, along with the
+// default one, by the changes in added, which are in track order
+template <typename T>
+static void replaceTrackChanges(std::vector<T>& changes,
+                                const std::vector<bool>& changed,
+                                std::vector<T>& added) {
+    std::erase_if(changes, [&changed](const T& c) {
+        return c.track >= changed.size() || changed[c.track];
+    });
+    // Same order as sortTimeMapEvents over every track, the changes kept are
+    // already in it
+    auto order = [](const T& a, const T& b) {
+        return a.time < b.time || (a.time == b.time && a.track < b.track);
+    };
+    std::stable_sort(added.begin(), added.end(), order);
+    const std::size_t kept = changes.size();
+    changes.insert(changes.end(), added.begin(), added.end());
+    std::inplace_merge(changes.begin(), changes.begin() + kept, changes.end(),
+                       order);
+}
+
+void updateTimeMaps(struct MidiFile& file, const std::vector<u16>& tracks) {
+    std::vector<bool> changed(file.tracks, false);
+    struct TimeMapEvents events;
+    for (u16 track : tracks) {
+        changed[track] = true;
+        events.track = track;
+        collectTimeMapEvents(file.data[track], events);
+    }
+
+    std::vector<TempoChange> tempos;
+    tempos.reserve(events.tempos.size());
+    for (const std::pair<v_len, TempoEvent>& tempo : events.tempos) {
+        tempos.emplace_back(TempoChange{
+            .time = tempo.first,
             .timeMicros = 0,
-            .microsPerTick = getMicrosPerTick(file.division, 500000)});
+            .microsPerTick = getMicrosPerTick(file.division, tempo.second.MPB),
+            .track = tempo.second.track});
+    }
+    replaceTrackChanges(file.timingInfo, changed, tempos);
+    if (file.timingInfo.empty() || file.timingInfo[0].time != 0) {
+        // default 120 bpm
+        file.timingInfo.insert(
+            file.timingInfo.begin(),
+            TempoChange{.time = 0,
+                        .timeMicros = 0,
+                        .microsPerTick =
+                            getMicrosPerTick(file.division, 500000)});
+    }
+    retimeTimingMap(file, 0);
+
+    std::vector<TimeSignatureChange> signatures;
+    signatures.reserve(events.signatures.size());
+    for (const std::pair<v_len, SignatureEvent>& sig : events.signatures) {
+        signatures.emplace_back(
+            TimeSignatureChange{.time = sig.first,
+                                .bar = 0,
+                                .signature = sig.second.signature,
+                                .track = sig.second.track});
+    }
+    replaceTrackChanges(file.timeSignatureInfo, changed, signatures);
+    if (file.timeSignatureInfo.empty() ||
+        file.timeSignatureInfo[0].time != 0) {
+        // default 4/4
+        file.timeSignatureInfo.insert(
+            file.timeSignatureInfo.begin(),
+            TimeSignatureChange{.time = 0,
+                                .bar = 0,
+                                .signature = TimeSignature{.numerator = 4,
+                                                           .denominator = 2,
+                                                           .TPM = 24,
+                                                           .noteDivision = 8}});
+    }
+    rebarTimeSignatureMap(file);
+}
+
+void getTimesMicros(const std::vector<TempoChange>& timingInfo,
+                    const v_len* ticks, std::size_t n, u64* res) {
+    if (timingInfo.empty())
+        throw std::runtime_error("Empty list to BSearch in !");
+    if (n == 0) return;
+    std::size_t t = &getLastBefore(timingInfo, ticks[0]) - timingInfo.data();
+    for (std::size_t i = 0; i < n; i++) {
+        while (t + 1 < timingInfo.size() && timingInfo[t + 1].time <= ticks[i])
+            t++;
+        res[i] = getTimeMicros(timingInfo[t], ticks[i]);
+    }
+}
+
+void getBars(const std::vector<TimeSignatureChange>& timeSignatureInfo,
+             const v_len* ticks, std::size_t n, struct BarTime* res) {
+    if (timeSignatureInfo.empty())
+        throw std::runtime_error("Empty list to BSearch in !");
+    if (n == 0) return;
+    std::size_t s = &getLastBefore(timeSignatureInfo, ticks[0]) -
+                    timeSignatureInfo.data();
+    for (std::size_t i = 0; i < n; i++) {
+        while (s + 1 < timeSignatureInfo.size() &&
+               timeSignatureInfo[s + 1].time <= ticks[i])
+            s++;
+        res[i] = getBar(timeSignatureInfo[s], ticks[i]);
+    }
+}
+
+void updateTrackTimes(const struct MidiFile& file,
+                      const struct MidiTrack& track, struct TrackTimes& times,
+                      std::size_t first, std::size_t count) {
+    const EventStore& list = track.list;
+    count = std::min(count, list.size() - std::min(first, list.size()));
+    if (times.mapsVersion == file.timeMapsVersion &&
+        times.ticksGeneration == list.timesGeneration() &&
+        first >= times.first &&
+        first + count <= times.first + times.micros.size())
+        return;
+    times.mapsVersion = file.timeMapsVersion;
+    times.ticksGeneration = list.timesGeneration();
+    times.first = first;
+    times.micros.resize(count);
+    times.bars.resize(count);
+    if (file.timingInfo.empty() || file.timeSignatureInfo.empty()) return;
+
+    std::vector<v_len> ticks(count);
+    for (std::size_t i = 0; i < count; i++) ticks[i] = list.time(first + i);
+    // Ticks only go up so both maps are swept once instead of searched
+    getTimesMicros(file.timingInfo, ticks.data(), count, times.micros.data());
+    getBars(file.timeSignatureInfo, ticks.data(), count, times.bars.data());
+}
+
+// The generation of the events tells apart versions of a decoded track, the
+// bytes they are read from those of one that is not
+static bool sameTrackVersion(const struct MidiTrack& a,
+                             const struct MidiTrack& b) {
+    return a.decoded == b.decoded && a.data == b.data &&
+           a.length == b.length &&
+           a.list.timesGeneration() == b.list.timesGeneration();
+}
+
+std::unique_ptr<const struct MidiFile> snapshotMidiFile(
+    const std::shared_ptr<struct MidiFile>& file, struct SnapshotState& last) {
+    bool changed = last.file != file || last.tracks.size() != file->tracks ||
+                   last.length != file->length ||
+                   last.format != file->format ||
+                   last.division != file->division ||
+                   last.timeMapsVersion != file->timeMapsVersion;
+    if (last.file != file) last.tracks.clear();
+    last.tracks.resize(file->tracks);
+    for (u32 i = 0; i < file->tracks; i++) {
+        const struct MidiTrack& track = file->data[i];
+        // Only the fields set once the copy is made are read, the other
+        // thread only moves its cursors
+        if (last.tracks[i] && sameTrackVersion(*last.tracks[i], track))
+            continue;
+        last.tracks[i] = std::make_shared<const struct MidiTrack>(track);
+        changed = true;
+    }
+    if (!changed) return nullptr;
+    last.file = file;
+    last.length = file->length;
+    last.format = file->format;
+    last.division = file->division;
+    last.timeMapsVersion = file->timeMapsVersion;
+
+    std::unique_ptr<struct MidiFile> res(new MidiFile);
+    res->length = file->length;
+    res->format = file->format;
+    res->tracks = file->tracks;
+    res->division = file->division;
+    res->sharedTracks = last.tracks;
+    res->source = file->source;
+    res->timingInfo = file->timingInfo;
+    res->timeSignatureInfo = file->timeSignatureInfo;
+    res->timeMapsVersion = file->timeMapsVersion;
+    res->owner = file;
+    return res;
+}
+
+void computeTimeMaps(struct MidiFile& file) {
+    struct TimeMapEvents events;
+    for (u32 i = 0; i < file.tracks; i++) {
+        events.track = i;
+        collectTimeMapEvents(file.data[i], events);
     }
+    buildTimingMap(file, events.tempos);
+    buildTimeSignatureMap(file, events.signatures);
+}
+
+void computeTimingMap(struct MidiFile& file) {
+    struct TimeMapEvents events;
+    for (u32 i = 0; i < file.tracks; i++) {
+        events.track = i;
+        collectTimeMapEvents(file.data[i], events);
+    }
+    buildTimingMap(file, events.tempos);
+}
+
+void computeTimeSignatureMap(struct MidiFile& file) {
+    struct TimeMapEvents events;
+    for (u32 i = 0; i < file.tracks; i++) {
+        events.track = i;
+        collectTimeMapEvents(file.data[i], events);
+    }
+    buildTimeSignatureMap(file, events.signatures);
+}
+
+enum MidiError indexTrack(struct MidiTrack& track,
+                          struct TimeMapEvents* timeMaps) {
+    std::vector<struct TrackCursor> checkpoints;
+    struct TrackCursor cursor = {};
+    u32 count;
+    enum MidiError err =
+        walkMidiMessages<true>(track.data, track.data + track.length, cursor,
+                               UINT32_MAX, count, &checkpoints, timeMaps);
+    if (err != NONE) return err;
+    if (checkpoints.empty()) checkpoints.push_back(TrackCursor{});
+
+    track.index.checkpoints =
+        std::make_shared<const std::vector<struct TrackCursor>>(
+            std::move(checkpoints));
+    track.index.events = count;
+    return NONE;
 }
 
-enum MidiError decodeTrack(struct MidiFile& file, struct MidiTrack& track) {
+enum MidiError indexTrack(struct MidiTrack& track) {
+    return indexTrack(track, nullptr);
+}
+
+enum MidiError decodeTrack(struct MidiTrack& track) {
+    // The index also gives the exact event count
+    if (!track.index.built()) {
+        enum MidiError err = indexTrack(track);
+        if (err != NONE) return err;
+    }
+
+    track.list.clear();
+    track.list.reserve(track.index.events);
+    struct TrackCursor cursor = {};
     enum MidiError err =
-        decodeMidiMessages(track.data, track.data + track.length, track.list);
+        decodeMidiMessages(track.data, track.data + track.length, cursor,
+                           track.index.events, track.list);
     if (err != NONE) return err;
 
     track.decoded = true;
-    computeTimeMapsForTrack(file, track);
     return NONE;
 }
 
-// NB the data string must not be freed until the tracks have been decoded
-enum MidiError readMidiFile(u8* data, std::size_t length,
+enum MidiError ensureTrackDecoded(struct MidiTrack& track) {
+    if (track.decoded) return NONE;
+    return decodeTrack(track);
+}
+
+enum MidiError decodeTrackRange(struct MidiTrack& track, u32 first, u32 count,
+                                EventStore& res) {
+    if (!track.index.built()) {
+        enum MidiError err = indexTrack(track);
+        if (err != NONE) return err;
+    }
+    const u8* end = track.data + track.length;
+    first = std::min(first, track.index.events);
+    count = std::min(count, track.index.events - first);
+
+    struct TrackCursor cursor =
+        (*track.index.checkpoints)[first / TRACK_INDEX_INTERVAL];
+    u32 skipped;
+    enum MidiError err =
+        walkMidiMessages<true>(track.data, end, cursor,
+                               first % TRACK_INDEX_INTERVAL, skipped, nullptr);
+    if (err != NONE) return err;
+
+    res.clear();
+    res.reserve(count);
+    return decodeMidiMessages(track.data, end, cursor, count, res);
+}
+
+enum MidiError findEventAtTick(struct MidiTrack& track, v_len tick,
+                               u32& event) {
+    if (track.decoded) {
+        event = track.list.findTime(tick);
+        return NONE;
+    }
+    if (!track.index.built()) {
+        enum MidiError err = indexTrack(track);
+        if (err != NONE) return err;
+    }
+    const u8* end = track.data + track.length;
+    const std::vector<struct TrackCursor>& checkpoints =
+        *track.index.checkpoints;
+
+    // Last checkpoint whose previous event is before the tick
+    std::size_t k =
+        std::partition_point(checkpoints.begin(), checkpoints.end(),
+                             [tick](const struct TrackCursor& c) {
+                                 return c.time < tick;
+                             }) -
+        checkpoints.begin();
+    if (k > 0) k--;
+
+    struct TrackCursor cursor = checkpoints[k];
+    event = k * TRACK_INDEX_INTERVAL;
+    while (event < track.index.events) {
+        const u8* data = track.data + cursor.offset;
+        if (cursor.time + readVarLen(data, end) >= tick) break;
+        u32 n;
+        enum MidiError err =
+            walkMidiMessages<true>(track.data, end, cursor, 1, n, nullptr);
+        if (err != NONE) return err;
+        event++;
+    }
+    return NONE;
+}
+
+enum MidiError decodeTracks(struct MidiFile& file, ThreadPool& pool) {
+    std::vector<enum MidiError> errors(file.tracks, NONE);
+    std::vector<struct TimeMapEvents> events(file.tracks);
+
+    // Tracks are independent chunks, only the time maps are shared
+    pool.parallelFor(file.tracks, [&](std::size_t i) {
+        errors[i] = decodeTrack(file.data[i]);
+        events[i].track = i;
+        if (errors[i] == NONE) collectTimeMapEvents(file.data[i], events[i]);
+    });
+
+    for (enum MidiError err : errors) {
+        if (err != NONE) return err;
+    }
+
+    struct TimeMapEvents merged;
+    for (struct TimeMapEvents& e : events) {
+        merged.tempos.insert(merged.tempos.end(), e.tempos.begin(),
+                             e.tempos.end());
+        merged.signatures.insert(merged.signatures.end(),
+                                 e.signatures.begin(), e.signatures.end());
+    }
+    buildTimingMap(file, merged.tempos);
+    buildTimeSignatureMap(file, merged.signatures);
+    return NONE;
+}
+
+enum MidiError scanTracks(struct MidiFile& file, ThreadPool& pool) {
+    std::vector<enum MidiError> errors(file.tracks, NONE);
+    std::vector<struct TimeMapEvents> events(file.tracks);
+
+    pool.parallelFor(file.tracks, [&](std::size_t i) {
+        events[i].track = i;
+        if (file.data[i].decoded) {
+            collectTimeMapEvents(file.data[i], events[i]);
+        } else {
+            errors[i] = indexTrack(file.data[i], &events[i]);
+        }
+    });
+
+    for (enum MidiError err : errors) {
+        if (err != NONE) return err;
+    }
+
+    struct TimeMapEvents merged;
+    for (struct TimeMapEvents& e : events) {
+        merged.tempos.insert(merged.tempos.end(), e.tempos.begin(),
+                             e.tempos.end());
+        merged.signatures.insert(merged.signatures.end(),
+                                 e.signatures.begin(), e.signatures.end());
+    }
+    buildTimingMap(file, merged.tempos);
+    buildTimeSignatureMap(file, merged.signatures);
+    return NONE;
+}
+
+// NB the tracks point into data, which must outlive the result (see
+// MidiFile::source)
+enum MidiError readMidiFile(const u8* data, std::size_t length,
                             struct MidiFile*& res) {
     if (length < SZ_FILE_HEADER) return UNEXPECTED_EOF;
     if (!matchesHeader(data, "MThd")) return INVALID_HEADER;
 
-    u8* end = data + length;
+    const u8* end = data + length;
     data += 4;
 
     struct MidiFile* result = new MidiFile();
@@ -400,6 +1018,7 @@ enum MidiError readMidiFile(u8* data, std::size_t length,
     for (u16 i = 0; i < result->tracks; i++) {
         result->data[i].length = 0;
         result->data[i].decoded = false;
+        result->data[i].list.setArena(&result->arena);
     }
 
     for (u16 i = 0; i < result->tracks; i++) {
@@ -433,10 +1052,6 @@ enum MidiError readMidiFile(u8* data, std::size_t length,
     WRITE_CHAR(stream, data >> 16);        \
     WRITE_BIG_ENDIAN_U16(stream, data)
 
-#define WRITE_BIG_ENDIAN_U32(stream, data) \
-    WRITE_CHAR(stream, data >> 24);        \
-    WRITE_BIG_ENDIAN_U24(stream, data)
-
 inline void feedDeltaTime(v_len deltaTime, std::stringstream& stream) {
     char dat;
     if (deltaTime >= 1 << (7 * 3))
@@ -453,31 +1068,21 @@ enum MidiError encodeTrackEvent(const struct TrackEvent& event,
     char dat;
     feedDeltaTime(event.deltaTime, data);
     switch (event.type) {
-        case MIDI:
-            WRITE_CHAR(data, (event.midi.type << 4) | event.midi.channel);
+        case MIDI: {
+            const u8 status = (event.midi.type << 4) | event.midi.channel;
+            WRITE_CHAR(data, status);
             WRITE_CHAR(data, event.midi.data0);
-            switch (event.midi.type) {
-                default:
-                    WRITE_CHAR(data, event.midi.data1);
-                    break;
-                case PROGRAM_CHANGE:
-                case AFTERTOUCH:
-                    break;
-            }
-            break;
+            if (STATUS_TABLE[status].length == 2)
+                WRITE_CHAR(data, event.midi.data1);
+        } break;
         case SYSTEM_EVENT:
             WRITE_CHAR(data, event.sys.type);
-            switch (event.sys.type) {
-                case UND0:
-                case UND1:
-                case UND2:
-                case TUNE:
-                    break;
-                case SONG_POSITION:
+            switch (STATUS_TABLE[event.sys.type].length) {
+                case 2:
                     WRITE_CHAR(data, event.sys.data0);
                     WRITE_CHAR(data, event.sys.data1);
                     break;
-                case SONG_SELECT:
+                case 1:
                     WRITE_CHAR(data, event.sys.data0);
                     break;
             }
@@ -537,8 +1142,9 @@ enum MidiError encodeTrackEvent(const struct TrackEvent& event,
             }
             break;
         case SYSEX_EVENT:
-            WRITE_CHAR(data, 0xF0);
+            WRITE_CHAR(data, event.sysex->type);
             // data contains the final 0xF7
+            feedDeltaTime(event.sysex->length, data);
             data.write((char*)event.sysex->data, event.sysex->length);
             break;
         case UNKOWN:
@@ -549,50 +1155,225 @@ enum MidiError encodeTrackEvent(const struct TrackEvent& event,
     return NONE;
 }
 
-// FIXME implement running status (consecutive same type events compression)
-// NOTE : after being done using it do delete[] track->data;
-enum MidiError encodeMidiTrack(struct MidiTrack& track) {
-    // XXX maybe optimize a bit by writing whole structures in one write?
-    u32 len = (u32)(track.list.size() * 3.5f);
-    std::string s(len, '\0');
-    std::stringstream data(s);
+inline u8 varLenSize(v_len value) {
+    if (value >= 1 << (7 * 3)) return 4;
+    if (value >= 1 << (7 * 2)) return 3;
+    if (value >= 1 << 7) return 2;
+    return 1;
+}
+
+inline u8* writeVarLen(u8* out, v_len value) {
+    const u8 n = varLenSize(value);
+    for (u8 i = n - 1; i > 0; i--) *out++ = ((value >> (7 * i)) & 0x7F) | 0x80;
+    *out++ = value & 0x7F;
+    return out;
+}
+
+inline u8* writeBigEndianU32(u8* out, u32 value) {
+    *out++ = value >> 24;
+    *out++ = value >> 16;
+    *out++ = value >> 8;
+    *out++ = value;
+    return out;
+}
 
-    for (TrackEvent& event : track.list) {
-        encodeTrackEvent(event, data);
+std::size_t encodedEventSize(const EventStore& events, std::size_t i) {
+    std::size_t res = varLenSize(events.deltaTime(i));
+    switch (events.type(i)) {
+        case MIDI:
+        case SYSTEM_EVENT:
+            return res + 1 + STATUS_TABLE[events.status(i)].length;
+        case META:
+            res++;  // Meta type
+            [[fallthrough]];
+        case SYSEX_EVENT: {
+            const v_len length = events.payloadLength(i);
+            return res + 1 + varLenSize(length) + length;
+        }
+        default:
+            return res;
     }
+}
 
-    data.seekg(0, std::ios::end);
-    std::streampos sz = data.tellg();
-    data.seekg(0, std::ios::beg);
-    track.data = new u8[sz];
-    track.length = sz;
-    std::memcpy(track.data, data.str().c_str(), sz);
-    return NONE;
+u8* encodeTrackEvent(const EventStore& events, std::size_t i, u8* out) {
+    out = writeVarLen(out, events.deltaTime(i));
+    const u8 status = events.status(i);
+    switch (events.type(i)) {
+        case MIDI:
+        case SYSTEM_EVENT:
+            *out++ = status;
+            switch (STATUS_TABLE[status].length) {
+                case 2:
+                    *out++ = events.data0(i);
+                    *out++ = events.data1(i);
+                    break;
+                case 1:
+                    *out++ = events.data0(i);
+                    break;
+            }
+            break;
+        case META:
+        case SYSEX_EVENT: {
+            *out++ = status;
+            if (status == 0xFF) *out++ = events.data0(i);
+            const v_len length = events.payloadLength(i);
+            out = writeVarLen(out, length);
+            std::memcpy(out, events.payloadData(i), length);
+            out += length;
+        } break;
+        default:
+            break;
+    }
+    return out;
+}
+
+// Encodes the events of the track at out, or only counts the bytes when not
+// Writing so that sizes always match what is written
+template <bool Writing>
+std::size_t encodeMidiTrack(const struct MidiTrack& track,
+                            const struct WriteOptions& options, u8* out) {
+    const EventStore& events = track.list;
+    std::size_t res = 0;
+    u8 running = 0;
+    for (std::size_t i = 0; i < events.size(); i++) {
+        u8 status = events.status(i);
+        if (!(STATUS_TABLE[status].flags & STATUS_RUNNING)) {
+            // Meta, sysex and system events cancel running status
+            running = 0;
+            if (Writing) {
+                out = encodeTrackEvent(events, i, out);
+            } else {
+                res += encodedEventSize(events, i);
+            }
+            continue;
+        }
+        u8 data1 = events.data1(i);
+        if (options.noteOffAsNoteOn && (status >> 4) == NOTE_OFF &&
+            running == (status | 0x10)) {
+            status = running;
+            data1 = 0;
+        }
+        const u8 length = STATUS_TABLE[status].length;
+        const bool writeStatus = !options.runningStatus || status != running;
+        if (options.runningStatus) running = status;
+
+        const v_len delta = events.deltaTime(i);
+        if (!Writing) {
+            res += varLenSize(delta) + writeStatus + length;
+            continue;
+        }
+        out = writeVarLen(out, delta);
+        if (writeStatus) *out++ = status;
+        *out++ = events.data0(i);
+        if (length == 2) *out++ = data1;
+    }
+    return res;
+}
+
+void encodeFileHeader(const struct MidiFile& file, u8* out) {
+    std::memcpy(out, "MThd", 4);
+    out = writeBigEndianU32(out + 4, SZ_HEADER_CONTENT);
+    *out++ = file.format >> 8;
+    *out++ = file.format;
+    *out++ = file.tracks >> 8;
+    *out++ = file.tracks;
+    *out++ = file.division >> 8;
+    *out++ = file.division;
 }
 
-enum MidiError writeMidiFile(struct MidiFile& file, std::ostream& stream) {
-    constexpr char header[] = "MThd\0\0\0\6";
-    char dat = 0;
-    stream.write(header, 8);
-    WRITE_BIG_ENDIAN_U16(stream, file.format);
-    WRITE_BIG_ENDIAN_U16(stream, file.tracks);
-    WRITE_BIG_ENDIAN_U16(stream, file.division);
+// MTrk chunk of a track, the body is either freshly encoded or the original
+// bytes of the track
+struct EncodedTrack {
+    u8 header[SZ_TRACK_HEADER];
+    const u8* body = nullptr;
+    std::size_t size = 0;
+    std::unique_ptr<u8[]> encoded;
+};
 
+// Fills in the header, body is only set for tracks copied as they were read
+static void sizeTrackChunk(const struct MidiTrack& track,
+                           const struct WriteOptions& options,
+                           struct EncodedTrack& res) {
+    std::memcpy(res.header, "MTrk", 4);
+    if (!track.modified()) {
+        // Copied as is, so the write options do not apply to it
+        res.body = track.data;
+        res.size = track.length;
+    } else {
+        res.size = encodeMidiTrack<false>(track, options, nullptr);
+    }
+    writeBigEndianU32(res.header + 4, res.size);
+}
+
+static void encodeTrackChunk(const struct MidiTrack& track,
+                             const struct WriteOptions& options,
+                             struct EncodedTrack& res) {
+    if (res.body != nullptr) return;
+    res.encoded.reset(new u8[res.size]);
+    res.body = res.encoded.get();
+    encodeMidiTrack<true>(track, options, res.encoded.get());
+}
+
+enum MidiError writeMidiFile(struct MidiFile& file, std::ostream& stream,
+                             const struct WriteOptions& options) {
+    u8 header[SZ_FILE_HEADER];
+    encodeFileHeader(file, header);
+    stream.write((char*)header, SZ_FILE_HEADER);
     for (u16 t = 0; t < file.tracks; t++) {
-        MidiTrack& track = file.data[t];
-        if (!track.decoded) {
-            return INVALID_TRACK;
+        struct EncodedTrack track;
+        sizeTrackChunk(file.data[t], options, track);
+        encodeTrackChunk(file.data[t], options, track);
+        stream.write((char*)track.header, SZ_TRACK_HEADER);
+        stream.write((char*)track.body, track.size);
+    }
+    return NONE;
+}
+
+// Encoded bytes held at once while saving, on top of one batch of tracks
+#define WRITE_BATCH_BYTES (1 << 24)
+
+enum MidiError writeMidiFile(struct MidiFile& file, ThreadPool& pool,
+                             OutputFile& output,
+                             const struct WriteOptions& options) {
+    std::vector<struct EncodedTrack> tracks(file.tracks);
+    pool.parallelFor(file.tracks, [&](std::size_t i) {
+        sizeTrackChunk(file.data[i], options, tracks[i]);
+    });
+
+    u64 total = SZ_FILE_HEADER;
+    for (const struct EncodedTrack& track : tracks)
+        total += SZ_TRACK_HEADER + track.size;
+    if (!output.reserve(total)) return WRITE_FAILED;
+
+    u8 header[SZ_FILE_HEADER];
+    encodeFileHeader(file, header);
+    std::vector<struct OutputChunk> chunks;
+    chunks.push_back(OutputChunk{header, SZ_FILE_HEADER});
+
+    // Tracks are encoded a batch at a time and freed once written, so only
+    // the tracks copied from the source are ever all referenced at once
+    const std::size_t batchTracks = pool.size() + 1;
+    std::size_t t = 0;
+    while (t < tracks.size()) {
+        std::size_t end = t, count = 0, bytes = 0;
+        for (; end < tracks.size(); end++) {
+            if (tracks[end].body != nullptr) continue;
+            if (count == batchTracks || bytes >= WRITE_BATCH_BYTES) break;
+            count++;
+            bytes += tracks[end].size;
         }
-        enum MidiError err = encodeMidiTrack(track);
-        if (err != NONE) {
-            return err;
+        pool.parallelFor(end - t, [&](std::size_t i) {
+            encodeTrackChunk(file.data[t + i], options, tracks[t + i]);
+        });
+        for (std::size_t i = t; i < end; i++) {
+            chunks.push_back(OutputChunk{tracks[i].header, SZ_TRACK_HEADER});
+            chunks.push_back(OutputChunk{tracks[i].body, tracks[i].size});
         }
-        stream << "MTrk";
-        WRITE_BIG_ENDIAN_U32(stream, track.length);
-        stream.write((char*)track.data, track.length);
-        delete[] track.data;
+        if (!output.write(chunks)) return WRITE_FAILED;
+        chunks.clear();
+        for (; t < end; t++) tracks[t].encoded.reset();
     }
-    return NONE;
+    return output.write(chunks) ? NONE : WRITE_FAILED;
 }
 
 #pragma endregion
@@ -735,7 +1516,9 @@ void printMidiTrackEvent(const struct TrackEvent& event) {
             }
             break;
         case SYSEX_EVENT: {
-            std::cout << "type = SYSEX 0xF0 " << event.sysex->data << "\n";
+            std::cout << "type = SYSEX 0x" << std::hex
+                      << (u32)event.sysex->type << std::dec << " "
+                      << event.sysex->data << "\n";
         } break;
         case UNKOWN:
             std::cout << "type = UNKOWN 0x??\n";
@@ -748,10 +1531,8 @@ void printMidiTrack(const struct MidiTrack& track) {
               << "\nDecoded: " << (track.decoded ? "true" : "false") << "\n";
 
     if (track.decoded) {
-        const std::vector<TrackEvent>& list = track.list;
-
-        for (const TrackEvent& e : list) {
-            printMidiTrackEvent(e);
+        for (std::size_t i = 0; i < track.list.size(); i++) {
+            printMidiTrackEvent(track.list.get(i));
         }
     } else {
         std::cout << std::hex << std::setfill('0');
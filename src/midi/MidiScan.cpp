@@ -0,0 +1,31 @@
+#include "MidiScan.hpp"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+std::size_t countDataBytesScalar(const u8* data, const u8* end) {
+    const u8* ptr = data;
+    while (ptr < end && *ptr < 0x80) ptr++;
+    return ptr - data;
+}
+
+std::size_t countDataBytes(const u8* data, const u8* end) {
+    const u8* ptr = data;
+#ifdef __AVX2__
+    while (end - ptr >= 32) {
+        u32 mask = _mm256_movemask_epi8(
+            _mm256_loadu_si256((const __m256i*)ptr));
+        if (mask != 0) return ptr - data + __builtin_ctz(mask);
+        ptr += 32;
+    }
+#endif
+#ifdef __SSE2__
+    while (end - ptr >= 16) {
+        u32 mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ptr));
+        if (mask != 0) return ptr - data + __builtin_ctz(mask);
+        ptr += 16;
+    }
+#endif
+    return ptr - data + countDataBytesScalar(ptr, end);
+}
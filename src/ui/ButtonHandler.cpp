@@ -10,4 +10,6 @@ void ButtonHandler::registerAll(Editor* editor) {
     this->registerButton("Add event", [=]() { editor->openAddEventEditor(); });
     this->registerButton("Remove event",
                          [=]() { editor->deleteSelectedEvent(); });
+    this->registerButton("Undo", [=]() { editor->undo(); });
+    this->registerButton("Redo", [=]() { editor->redo(); });
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <iostream>
 #include <stdexcept>
 
+#include "OutputFile.hpp"
+
 Editor::Editor() : toolStrip(*this, resourceManager, buttonHandler) {
     glfwSetErrorCallback([](int error, const char* description) {
         std::cerr << "GLFW Error " << error << ": " << description << std::endl;
@@ -48,24 +50,68 @@ void Editor::load() {
 }
 
 void Editor::update() {
-    this->buttonHandler.runAll();
+    // Before the buttons, so a save uses the options set before it
+    bool changed = runTasks();
+    changed |= this->buttonHandler.runAll();
 
+    std::shared_ptr<MidiFile> data = getData();
+    if (!data) return;
     if (tempoHasChanged) {
-        data->timingInfo.clear();
-
-        for (u32 j = 0; j < data->tracks; j++) {
-            computeTimeMapsForTrack(*data, data->data[j]);
-        }
+        computeTimingMap(*data);
         tempoHasChanged = false;
+        changed = true;
     }
     if (timeSignatureHasChanged) {
-        data->timeSignatureInfo.clear();
+        computeTimeSignatureMap(*data);
+        timeSignatureHasChanged = false;
+        changed = true;
+    }
+    changed |= decodeShownTracks(*data);
+
+    // Edits of an open transaction are only shown once it is committed
+    this->unpublished |= changed;
+    if (this->unpublished && this->editDepth == 0) {
+        // Null if the buttons and tasks left the document as it was
+        std::unique_ptr<const MidiFile> version =
+            snapshotMidiFile(data, this->lastPublished);
+        if (version) this->published.publish(std::move(version));
+        this->unpublished = false;
+    }
+}
+
+void Editor::runOnUpdate(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(this->tasksMutex);
+    this->tasks.push_back(std::move(task));
+}
 
-        for (u32 j = 0; j < data->tracks; j++) {
-            computeTimeSignatureMapForTrack(*data, data->data[j]);
+bool Editor::runTasks() {
+    std::vector<std::function<void()>> run;
+    {
+        std::lock_guard<std::mutex> lock(this->tasksMutex);
+        run.swap(this->tasks);
+    }
+    for (std::function<void()>& task : run) task();
+    return !run.empty();
+}
+
+// Tracks are only decoded once rows of them are shown
+bool Editor::decodeShownTracks(MidiFile& file) {
+    bool changed = false;
+    u64 o = this->offset, remaining = this->eventTableSize;
+    const u32 shown = this->trackToShow;
+    for (u32 j = 0; j < file.tracks && remaining > 0; j++) {
+        if (shown != 0 && shown != j + 1) continue;
+        MidiTrack& track = file.data[j];
+        if (o >= track.size()) {
+            o -= track.size();
+            continue;
         }
-        timeSignatureHasChanged = false;
+        if (!track.decoded && ensureTrackDecoded(track) == NONE)
+            changed = true;
+        remaining -= std::min<u64>(remaining, track.size() - o);
+        o = 0;
     }
+    return changed;
 }
 
 constexpr ImGuiWindowFlags MAIN_WINDOW_FLAGS = ImGuiWindowFlags_NoCollapse |
@@ -115,7 +161,8 @@ void setupDockSpace() {
 
 void Editor::render() {
     ImGuiIO& io = ImGui::GetIO();
-    std::shared_ptr<MidiFile> data = this->getData();
+    // Stays the same for the whole frame whatever update() does meanwhile
+    const MidiFile* data = this->published.read();
 
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplGlfw_NewFrame();
@@ -123,6 +170,14 @@ void Editor::render() {
     ImGui::NewFrame();
     ImGui::GetFont()->Scale = 1.5f;
 
+    // Text fields have their own undo
+    if (!io.WantTextInput && io.KeyCtrl) {
+        if (ImGui::IsKeyPressed(ImGuiKey_Z, false))
+            buttonHandler.pressButton(io.KeyShift ? "Redo" : "Undo");
+        else if (ImGui::IsKeyPressed(ImGuiKey_Y, false))
+            buttonHandler.pressButton("Redo");
+    }
+
     ImGui::SetNextWindowSize(io.DisplaySize);
     ImGui::SetNextWindowPos({0, 0}, ImGuiCond_Always);
     if (ImGui::Begin("Editor", NULL, MAIN_WINDOW_FLAGS)) {
@@ -160,109 +215,137 @@ void Editor::render() {
 #include <fstream>
 // TODO put that elsewhere
 void Editor::loadFile(std::string path) {
-    std::ifstream f(path, std::fstream::in);
-    if (!f.is_open()) {
+    std::shared_ptr<MappedFile> source = std::make_shared<MappedFile>();
+    if (!source->open(path)) {
         this->showError("Could not open MIDI file !");
         return;
     }
 
-    f.seekg(0, std::fstream::end);
-    std::size_t sz = f.tellg();
-    if (f.fail()) {
-        f.close();
-        this->showError("Could not read MIDI file !");
-        return;
-    }
-
-    u8* buffer = new u8[sz];
-    if (!buffer) {
-        f.close();
-        this->showError("Not enough memory !");
-        return;
-    }
-    f.seekg(std::fstream::beg);
-    f.read((char*)buffer, sz);
-    f.close();
-
     struct MidiFile* midi = nullptr;
 
-    enum MidiError err = readMidiFile(buffer, sz, midi);
+    enum MidiError err = readMidiFile(source->data(), source->size(), midi);
     if (err) {
         this->showError(std::string("Error when parsing midi file headers ! ") +
                         std::to_string(err));
-        delete[] buffer;
         return;
     }
+    // Tracks are decoded in place and events view their payloads in it, so
+    // the mapping lives as long as the file
+    midi->source = std::move(source);
 
     // printMidiFile(*midi);
 
-    for (u32 i = 0; i < midi->tracks; i++) {
-        struct MidiTrack& track = midi->data[i];
-        err = decodeTrack(*midi, track);
-        if (err) {
-            delete midi;
-            delete[] buffer;
-            this->showError(std::string("Error when decoding midi tracks ! ") +
-                            std::to_string(err));
-            return;
-        }
+    // Tracks are only decoded once shown or saved
+    err = scanTracks(*midi, workers);
+    if (err) {
+        delete midi;
+        this->showError(std::string("Error when decoding midi tracks ! ") +
+                        std::to_string(err));
+        return;
     }
 
-    delete[] buffer;
-
     this->setData(std::shared_ptr<MidiFile>(midi));
 }
 
 void Editor::saveFile(std::string path) {
-    std::ofstream stream(path, std::ios::out | std::ios::binary);
     std::shared_ptr<MidiFile> file = getData();
-    if (!file) return;
-    enum MidiError err = writeMidiFile(*file, stream);
+    // The dialog was cancelled
+    if (!file || path.empty()) return;
+    // Events may still point into the mapping of the file being overwritten,
+    // so it is replaced rather than truncated. On POSIX the mapping keeps the
+    // old file alive, on Windows it is renamed aside until it is unmapped
+    AtomicFile output;
+    if (!output.open(path)) {
+        this->showError("Could not create a temporary file next to " + path +
+                        " !");
+        return;
+    }
+    enum MidiError err =
+        writeMidiFile(*file, workers, output.output(), saveOptions);
+    if (err == NONE && !output.commit()) err = WRITE_FAILED;
     if (err != NONE) {
         std::cerr << "Could not save midi file : " << err << "\n";
+        output.discard();
     }
 }
 
-// XXX fix potential race condition
 void Editor::addEvent(u16 track, u32 pos, const TrackEvent& e) {
     std::shared_ptr<MidiFile> data = getData();
     if (!data) return;
-    MidiTrack& t = data->data[track];
-    std::vector<TrackEvent>& eList = t.list;
-    eList.insert(eList.cbegin() + pos, e);
+    if (ensureTrackDecoded(data->data[track]) != NONE) return;
+    EventStore& eList = data->data[track].list;
+    beginTrackEdit(*data, track);
+    eList.insert(pos, e);
+    endTrackEdit(*data);
+    if (this->editDepth > 0) return;
     this->totalEvents++;
-    if (e.type == META) {
-        if (e.meta->type == SET_TEMPO) {
-            this->tempoHasChanged = true;
-        } else if (e.meta->type == TIME_SIGNATURE) {
-            this->timeSignatureHasChanged = true;
-        }
+    // Later changes of the track moved, in both maps
+    if (e.deltaTime != 0) {
+        if (!this->tempoHasChanged || !this->timeSignatureHasChanged)
+            updateTimeMaps(*data, {track});
+        return;
+    }
+    if (e.type == META && e.meta->type == TIME_SIGNATURE) {
+        this->timeSignatureHasChanged = true;
+    }
+    if (!updateTimingMapOnInsert(*data, track, pos)) {
+        this->tempoHasChanged = true;
     }
-    computeTimes(eList);
 }
 
 void Editor::removeEvent(u16 track, u32 pos) {
     std::shared_ptr<MidiFile> data = getData();
     if (!data) return;
-    MidiTrack& t = data->data[track];
-    std::vector<TrackEvent>& eList = t.list;
-    const TrackEvent e(eList[pos]);
-    if (e.type == META && e.meta->type == END_OF_TRACK) {
+    if (ensureTrackDecoded(data->data[track]) != NONE) return;
+    EventStore& eList = data->data[track].list;
+    if (eList.isMeta(pos, END_OF_TRACK)) {
         this->showError(
             "Cannot delete an end of track event !\n"
             "Delete the track instead !");
         return;
     }
-    eList.erase(eList.cbegin() + pos);
-    this->totalEvents--;
-    if (e.type == META) {
-        if (e.meta->type == SET_TEMPO) {
-            this->tempoHasChanged = true;
-        } else if (e.meta->type == TIME_SIGNATURE) {
+    beginTrackEdit(*data, track);
+    const bool moves = eList.deltaTime(pos) != 0;
+    if (this->editDepth == 0) {
+        if (!moves && eList.isMeta(pos, TIME_SIGNATURE)) {
             this->timeSignatureHasChanged = true;
         }
+        if (!moves && !updateTimingMapOnErase(*data, track, pos)) {
+            this->tempoHasChanged = true;
+        }
+        this->totalEvents--;
     }
-    computeTimes(eList);
+    eList.erase(pos);
+    endTrackEdit(*data);
+    // Later changes of the track moved back, in both maps
+    if (this->editDepth == 0 && moves &&
+        (!this->tempoHasChanged || !this->timeSignatureHasChanged))
+        updateTimeMaps(*data, {track});
+}
+
+void Editor::jumpToTick(v_len tick) {
+    std::shared_ptr<MidiFile> data = getData();
+    if (!data || data->tracks == 0) return;
+    const u32 shown = this->trackToShow;
+    u32 track = shown != 0 ? shown - 1 : this->selectedTrack.load();
+    if (track >= data->tracks) return;
+    u32 event;
+    if (findEventAtTick(data->data[track], tick, event) != NONE) return;
+    // Rows of every track before it come first when all of them are shown
+    u64 row = event;
+    if (shown == 0) {
+        for (u32 i = 0; i < track; i++) row += data->data[i].size();
+    }
+    this->offset = row;
+}
+
+void Editor::setOffset(u64 row) {
+    std::shared_ptr<MidiFile> data = getData();
+    const u32 shown = this->trackToShow;
+    u64 rows = this->totalEvents;
+    if (data && shown != 0 && shown <= data->tracks)
+        rows = data->data[shown - 1].size();
+    this->offset = std::min(row, rows);
 }
 
 void Editor::addTrack(u16 idx) {
@@ -278,7 +361,8 @@ void Editor::addTrack(u16 idx) {
             data->data[i].decoded = true;
             data->data[i].data = NULL;
             data->data[i].length = 0;
-            data->data[i].list = std::vector<TrackEvent>();
+            data->data[i].list.clear();
+            data->data[i].list.setArena(&data->arena);
 
             TrackEvent endTrack;
             endTrack.deltaTime = 0;
@@ -293,6 +377,10 @@ void Editor::addTrack(u16 idx) {
 
     delete[] old;
     data->tracks++;
+    // Changes at the same tick are ordered by track
+    this->tempoHasChanged = this->timeSignatureHasChanged = true;
+    if (this->editDepth > 0) this->editMovedTracks = true;
+    this->history.clear();
 }
 
 void Editor::removeTrack(u16 idx) {
@@ -302,6 +390,125 @@ void Editor::removeTrack(u16 idx) {
     for (u16 i = idx; i < data->tracks; i++) {
         data->data[i] = std::move(data->data[i + 1]);
     }
+    this->tempoHasChanged = this->timeSignatureHasChanged = true;
+    if (this->editDepth > 0) this->editMovedTracks = true;
+    this->history.clear();
+}
+
+void Editor::swapTracks(u16 a, u16 b) {
+    std::shared_ptr<MidiFile> data = getData();
+    if (!data || a >= data->tracks || b >= data->tracks) return;
+    std::swap(data->data[a], data->data[b]);
+    // Changes at the same tick are ordered by track
+    this->tempoHasChanged = this->timeSignatureHasChanged = true;
+    if (this->editDepth > 0) this->editMovedTracks = true;
+    this->history.clear();
+}
+
+void Editor::setEvent(u16 track, u32 pos, const TrackEvent& e) {
+    std::shared_ptr<MidiFile> data = getData();
+    if (!data || track >= data->tracks) return;
+    if (ensureTrackDecoded(data->data[track]) != NONE) return;
+    EventStore& eList = data->data[track].list;
+    // The table may have shown an older version
+    if (pos >= eList.size()) return;
+    beginTrackEdit(*data, track);
+    eList.set(pos, e);
+    endTrackEdit(*data);
+    if (this->editDepth > 0) return;
+    if (!updateTimingMapOnSet(*data, track, pos)) {
+        this->tempoHasChanged = true;
+    } else if (e.type == META && e.meta->type == TIME_SIGNATURE) {
+        this->timeSignatureHasChanged = true;
+    }
+}
+
+void Editor::setDeltaTime(u16 track, u32 pos, v_len delta) {
+    std::shared_ptr<MidiFile> data = getData();
+    if (!data || track >= data->tracks) return;
+    if (ensureTrackDecoded(data->data[track]) != NONE) return;
+    EventStore& eList = data->data[track].list;
+    if (pos >= eList.size()) return;
+    beginTrackEdit(*data, track);
+    eList.setDeltaTime(pos, delta);
+    endTrackEdit(*data);
+    // Later changes of the track moved
+    if (this->editDepth == 0 &&
+        (!this->tempoHasChanged || !this->timeSignatureHasChanged))
+        updateTimeMaps(*data, {track});
+}
+
+void Editor::touchTrack(const MidiFile& file, u16 track) {
+    if (this->editedTracks.emplace(track, file.data[track].size()).second)
+        this->history.record(file, track);
+}
+
+void Editor::beginTrackEdit(const MidiFile& file, u16 track) {
+    if (this->editDepth > 0) {
+        touchTrack(file, track);
+        return;
+    }
+    this->history.begin();
+    this->history.record(file, track);
+}
+
+void Editor::endTrackEdit(const MidiFile& file) {
+    if (this->editDepth == 0) this->history.commit(file);
+}
+
+void Editor::beginEdit() {
+    if (this->editDepth++ == 0) this->history.begin();
+}
+
+void Editor::commitEdit() {
+    if (this->editDepth == 0 || --this->editDepth > 0) return;
+    std::shared_ptr<MidiFile> data = getData();
+    if (data && this->editMovedTracks) {
+        // Track numbers changed, nothing recorded can be trusted
+        this->totalEvents = 0;
+        for (u32 track = 0; track < data->tracks; track++) {
+            this->totalEvents += data->data[track].size();
+        }
+    } else if (data && !this->editedTracks.empty()) {
+        std::vector<u16> tracks;
+        tracks.reserve(this->editedTracks.size());
+        for (const std::pair<const u16, std::size_t>& track :
+             this->editedTracks) {
+            tracks.push_back(track.first);
+            this->totalEvents += data->data[track.first].size();
+            this->totalEvents -= track.second;
+        }
+        // Both maps are rebuilt at the next update anyway
+        if (!this->tempoHasChanged || !this->timeSignatureHasChanged)
+            updateTimeMaps(*data, tracks);
+    }
+    if (data && !this->editMovedTracks) this->history.commit(*data);
+    this->editedTracks.clear();
+    this->editMovedTracks = false;
+}
+
+void Editor::tracksRestored(MidiFile& file, const std::vector<u16>& tracks) {
+    this->totalEvents = 0;
+    for (u32 track = 0; track < file.tracks; track++) {
+        this->totalEvents += file.data[track].size();
+    }
+    // Both maps are rebuilt at the next update anyway
+    if (!this->tempoHasChanged || !this->timeSignatureHasChanged)
+        updateTimeMaps(file, tracks);
+}
+
+void Editor::undo() {
+    std::shared_ptr<MidiFile> data = getData();
+    if (!data || this->editDepth > 0) return;
+    std::vector<u16> tracks;
+    if (this->history.undo(*data, tracks)) tracksRestored(*data, tracks);
+}
+
+void Editor::redo() {
+    std::shared_ptr<MidiFile> data = getData();
+    if (!data || this->editDepth > 0) return;
+    std::vector<u16> tracks;
+    if (this->history.redo(*data, tracks)) tracksRestored(*data, tracks);
 }
 
 Editor::~Editor() {
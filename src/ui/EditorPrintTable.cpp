@@ -1,11 +1,15 @@
 #include <algorithm>
+#include <cstring>
 
 #include "Editor.hpp"
 
-void Editor::printTextForTrackEventType(const TrackEvent& ev) {
-    switch (ev.type) {
+// Read from the columns, no event is built for it
+void Editor::printTextForTrackEventType(const EventStore& list,
+                                        std::size_t i) {
+    const u8 status = list.status(i);
+    switch (list.type(i)) {
         case MIDI:
-            switch (ev.midi.type) {
+            switch (status >> 4) {
                 case NOTE_OFF:
                     ImGui::Text("MIDI NOTE OFF");
                     break;
@@ -28,15 +32,15 @@ void Editor::printTextForTrackEventType(const TrackEvent& ev) {
                     ImGui::Text("MIDI PITCH WHEEL");
                     break;
                 default:
-                    ImGui::Text("MIDI 0x%02X", ev.midi.type);
+                    ImGui::Text("MIDI 0x%02X", status >> 4);
                     break;
             }
             break;
         case SYSTEM_EVENT:
-            ImGui::Text("SYSTEM 0x%02X", ev.sys.type);
+            ImGui::Text("SYSTEM 0x%02X", status);
             break;
         case META:
-            switch (ev.meta->type) {
+            switch (list.data0(i)) {
                 case SEQUENCE_NUMBER:
                     ImGui::Text("META SEQUENCE NUMBER");
                     break;
@@ -84,12 +88,12 @@ void Editor::printTextForTrackEventType(const TrackEvent& ev) {
                     break;
                 case SPECIFIC:
                 default:
-                    ImGui::Text("META 0x%02X", ev.meta->type);
+                    ImGui::Text("META 0x%02X", list.data0(i));
                     break;
             }
             break;
         case SYSEX_EVENT:
-            ImGui::Text("SYSEX 0xF0");
+            ImGui::Text("SYSEX 0x%02X", status);
             break;
         case UNKOWN:
             ImGui::Text("UNKOWN 0x??");
@@ -195,98 +199,7 @@ bool Editor::printDataTextForTrackEvent(TrackEvent& ev) {
         case SYSTEM_EVENT:
             break;
         case META:
-            switch (ev.meta->type) {
-                case SEQUENCE_NUMBER:
-                    i = ev.meta->seqNumber;
-                    changed |= ImGui::InputInt("sequence number", &i, 0, 10);
-                    ev.meta->seqNumber = std::clamp(i, 0, 255);
-                    break;
-                case TEXT:
-                case COPYRIGHT:
-                case NAME:
-                case INSTRUMENT_NAME:
-                case LYRIC:
-                case MARKER:
-                case CUE:
-                case DEVICE_NAME:
-                    ImGui::PushItemWidth(WIDTH * 3);
-                    changed |= ImGui::InputText("content", (char*)ev.meta->data,
-                                                ev.meta->length + 1);
-                    break;
-                case MIDI_CHANNEL_PREFIX:
-                    i = ev.meta->channel;
-                    changed |= ImGui::InputInt("channel", &i, 0, 8);
-                    ev.meta->channel = std::clamp(i, 0, 15);
-                    break;
-                case END_OF_TRACK:
-                    break;
-                case SET_TEMPO:
-                    i = (int)ev.meta->MPQ;
-                    changed |= ImGui::InputInt("MPQ", &i, 0, 0x10000);
-                    ev.meta->MPQ = std::clamp(i, 0, 0xFFFFFF);
-                    break;
-                case SMPTE_OFFSET: {
-                    int h = ev.meta->startTime.hours,
-                        m = ev.meta->startTime.minutes,
-                        s = ev.meta->startTime.seconds,
-                        f = ev.meta->startTime.frames,
-                        ff = ev.meta->startTime.frameFractions;
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("hours", &h, 0, 5);
-                    ImGui::SameLine();
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("minutes", &m, 0, 5);
-                    ImGui::SameLine();
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("seconds", &s, 0, 5);
-
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("frames", &f, 0, 5);
-                    ImGui::SameLine();
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("frame fractions", &ff, 0, 10);
-                    ev.meta->startTime.hours = std::clamp(h, 0, 0xFF);
-                    ev.meta->startTime.minutes = std::clamp(m, 0, 59);
-                    ev.meta->startTime.seconds = std::clamp(s, 0, 59);
-                    ev.meta->startTime.frames = std::clamp(f, 0, 29);
-                    ev.meta->startTime.frameFractions = std::clamp(ff, 0, 99);
-                } break;
-                case TIME_SIGNATURE: {
-                    int n = ev.meta->timeSignature.numerator,
-                        d = ev.meta->timeSignature.denominator,
-                        nd = ev.meta->timeSignature.noteDivision,
-                        tpm = ev.meta->timeSignature.TPM;
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("numerator", &n, 0, 5);
-                    ImGui::SameLine();
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("denominator", &d, 0, 5);
-
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("note division", &nd, 0, 5);
-                    ImGui::SameLine();
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("tpm", &tpm, 0, 5);
-                    ev.meta->timeSignature.numerator = std::clamp(n, 0, 0xFF);
-                    ev.meta->timeSignature.denominator = std::clamp(d, 0, 0xFF);
-                    ev.meta->timeSignature.noteDivision =
-                        std::clamp(nd, 0, 0xFF);
-                    ev.meta->timeSignature.TPM = std::clamp(tpm, 0, 0xFF);
-                } break;
-                case KEY_SIGNATURE:
-                    i = ev.meta->key.sharps;
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |= ImGui::InputInt("sharps", &i, 0, 4);
-                    ImGui::SameLine();
-                    ImGui::PushItemWidth(WIDTH);
-                    changed |=
-                        ImGui::Checkbox("minor", (bool*)&ev.meta->key.minor);
-                    ev.meta->key.sharps = std::clamp(i, -7, 7);
-                    break;
-                case SPECIFIC:
-                default:
-                    break;
-            }
+            changed |= printDataTextForMetaEvent(*ev.meta);
             break;
         case SYSEX_EVENT:
             break;
@@ -295,4 +208,159 @@ bool Editor::printDataTextForTrackEvent(TrackEvent& ev) {
             break;
     }
     return changed;
-}
\ No newline at end of file
+}
+
+bool Editor::printDataTextForMetaEvent(MetaEvent& meta) {
+    int i;
+    bool changed = false;
+    switch (meta.type) {
+        case SEQUENCE_NUMBER:
+            i = meta.seqNumber;
+            changed |= ImGui::InputInt("sequence number", &i, 0, 10);
+            meta.seqNumber = std::clamp(i, 0, 255);
+            break;
+        case TEXT:
+        case COPYRIGHT:
+        case NAME:
+        case INSTRUMENT_NAME:
+        case LYRIC:
+        case MARKER:
+        case CUE:
+        case DEVICE_NAME:
+            ImGui::PushItemWidth(WIDTH * 3);
+            changed |= ImGui::InputText("content", (char*)meta.data,
+                                        meta.length + 1);
+            break;
+        case MIDI_CHANNEL_PREFIX:
+            i = meta.channel;
+            changed |= ImGui::InputInt("channel", &i, 0, 8);
+            meta.channel = std::clamp(i, 0, 15);
+            break;
+        case END_OF_TRACK:
+            break;
+        case SET_TEMPO:
+            i = (int)meta.MPQ;
+            changed |= ImGui::InputInt("MPQ", &i, 0, 0x10000);
+            meta.MPQ = std::clamp(i, 0, 0xFFFFFF);
+            break;
+        case SMPTE_OFFSET: {
+            int h = meta.startTime.hours,
+                m = meta.startTime.minutes,
+                s = meta.startTime.seconds,
+                f = meta.startTime.frames,
+                ff = meta.startTime.frameFractions;
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("hours", &h, 0, 5);
+            ImGui::SameLine();
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("minutes", &m, 0, 5);
+            ImGui::SameLine();
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("seconds", &s, 0, 5);
+
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("frames", &f, 0, 5);
+            ImGui::SameLine();
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("frame fractions", &ff, 0, 10);
+            meta.startTime.hours = std::clamp(h, 0, 0xFF);
+            meta.startTime.minutes = std::clamp(m, 0, 59);
+            meta.startTime.seconds = std::clamp(s, 0, 59);
+            meta.startTime.frames = std::clamp(f, 0, 29);
+            meta.startTime.frameFractions = std::clamp(ff, 0, 99);
+        } break;
+        case TIME_SIGNATURE: {
+            int n = meta.timeSignature.numerator,
+                d = meta.timeSignature.denominator,
+                nd = meta.timeSignature.noteDivision,
+                tpm = meta.timeSignature.TPM;
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("numerator", &n, 0, 5);
+            ImGui::SameLine();
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("denominator", &d, 0, 5);
+
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("note division", &nd, 0, 5);
+            ImGui::SameLine();
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("tpm", &tpm, 0, 5);
+            meta.timeSignature.numerator = std::clamp(n, 0, 0xFF);
+            meta.timeSignature.denominator = std::clamp(d, 0, 0xFF);
+            meta.timeSignature.noteDivision =
+                std::clamp(nd, 0, 0xFF);
+            meta.timeSignature.TPM = std::clamp(tpm, 0, 0xFF);
+        } break;
+        case KEY_SIGNATURE:
+            i = meta.key.sharps;
+            ImGui::PushItemWidth(WIDTH);
+            changed |= ImGui::InputInt("sharps", &i, 0, 4);
+            ImGui::SameLine();
+            ImGui::PushItemWidth(WIDTH);
+            changed |=
+                ImGui::Checkbox("minor", (bool*)&meta.key.minor);
+            meta.key.sharps = std::clamp(i, -7, 7);
+            break;
+        case SPECIFIC:
+        default:
+            break;
+    }
+    return changed;
+}
+
+// Text payloads are edited in a buffer reused by every row, other fields in
+// events on the stack, so only a row whose input changed builds an event
+bool Editor::printDataTextForEvent(const EventStore& list, std::size_t i,
+                                   TrackEvent& edited) {
+    switch (list.type(i)) {
+        case MIDI:
+        case SYSTEM_EVENT: {
+            // Without a payload, nothing is allocated
+            TrackEvent ev = list.get(i);
+            if (!printDataTextForTrackEvent(ev)) return false;
+            edited = std::move(ev);
+            return true;
+        }
+        case META:
+            break;
+        default:
+            return false;
+    }
+    MetaEvent meta(list.data0(i));
+    switch (meta.type) {
+        case TEXT:
+        case COPYRIGHT:
+        case NAME:
+        case INSTRUMENT_NAME:
+        case LYRIC:
+        case MARKER:
+        case CUE:
+        case DEVICE_NAME: {
+            this->tableText.assign((const char*)list.payloadData(i),
+                                   list.payloadLength(i));
+            ImGui::PushItemWidth(WIDTH * 3);
+            if (!ImGui::InputText("content", this->tableText.data(),
+                                  this->tableText.size() + 1))
+                return false;
+            edited = list.get(i);
+            edited.meta->length = std::strlen(this->tableText.c_str());
+            std::memcpy(edited.meta->data, this->tableText.c_str(),
+                        edited.meta->length + 1);
+            return true;
+        }
+        case SEQUENCE_NUMBER:
+        case MIDI_CHANNEL_PREFIX:
+        case SET_TEMPO:
+        case SMPTE_OFFSET:
+        case TIME_SIGNATURE:
+        case KEY_SIGNATURE:
+            readMetaPayload(meta, list.payloadData(i), list.payloadLength(i));
+            if (!printDataTextForMetaEvent(meta)) return false;
+            edited = list.get(i);
+            delete edited.meta;
+            edited.meta = new MetaEvent(std::move(meta));
+            return true;
+        default:
+            return false;
+    }
+}
@@ -134,7 +134,7 @@ bool renderStringEditor(const char* label, std::string& result,
     return changed;
 }
 
-void Editor::renderEventAddEditor(std::shared_ptr<MidiFile>& data) {
+void Editor::renderEventAddEditor(const MidiFile* data) {
     if (!data) return;
     ImGui::SetNextWindowSizeConstraints({500, 450}, {900, 600});
     if (!ImGui::BeginPopupModal("Event add editor",
@@ -153,7 +153,7 @@ void Editor::renderEventAddEditor(std::shared_ptr<MidiFile>& data) {
     ImGui::SetNextItemWidth(150);
     changed |= ImGui::InputInt("New event's index", &buf);
     this->selectedEvent = std::clamp(
-        buf, 0, (int)(data->data[this->selectedTrack].list.size() - 1));
+        buf, 0, (int)(data->track(this->selectedTrack).size() - 1));
 
     ImGui::SetNextItemWidth(150);
     v = buffer.deltaTime;
@@ -367,7 +367,12 @@ void Editor::renderEventAddEditor(std::shared_ptr<MidiFile>& data) {
                               {0, 0}, ImGuiInputTextFlags_ReadOnly);
 
     if (ImGui::Button("Add")) {
-        this->addEvent(this->selectedTrack, this->selectedEvent, buffer);
+        // Copies the buffer along with its payload
+        const u16 track = this->selectedTrack;
+        const u32 pos = this->selectedEvent;
+        this->runOnUpdate([this, track, pos, e = TrackEvent(buffer)] {
+            addEvent(track, pos, e);
+        });
         this->addEventEditorOpen = false;
     }
     ImGui::EndPopup();
@@ -387,13 +392,14 @@ void Editor::renderError() {
     ImGui::EndPopup();
 }
 
-void Editor::renderTrackEditor(std::shared_ptr<MidiFile>& data) {
+void Editor::renderTrackEditor(const MidiFile* data) {
     if (!data) return;
     if (!ImGui::BeginPopupModal("Track editor", &this->trackEditorOpen)) {
         return;
     }
     if (ImGui::Button("Add")) {
-        this->addTrack(data->tracks);
+        const u16 track = data->tracks;
+        this->runOnUpdate([this, track] { addTrack(track); });
     }
 
     constexpr char COLS[][13] = {"Track number", "Events", "Open", "Move"};
@@ -421,9 +427,9 @@ void Editor::renderTrackEditor(std::shared_ptr<MidiFile>& data) {
         if (ImGui::TableNextColumn()) ImGui::Text("%d", i + 1);
         if (ImGui::TableNextColumn()) {
             if (sizeof(unsigned long long) == sizeof(std::size_t))
-                ImGui::Text("%llu", (unsigned long long)data->data[i].list.size());
+                ImGui::Text("%llu", (unsigned long long)data->track(i).size());
             else
-                ImGui::Text("%lu", (unsigned long)data->data[i].list.size());
+                ImGui::Text("%lu", (unsigned long)data->track(i).size());
         }
         if (ImGui::TableNextColumn()) {
             if (ImGui::Button("View")) {
@@ -434,13 +440,13 @@ void Editor::renderTrackEditor(std::shared_ptr<MidiFile>& data) {
         if (ImGui::TableNextColumn()) {
             if (i == 0) ImGui::BeginDisabled();
             if (ImGui::Button("^") && i > 0) {
-                std::swap(data->data[i - 1], data->data[i]);
+                this->runOnUpdate([this, i] { swapTracks(i - 1, i); });
             }
             if (i == 0) ImGui::EndDisabled();
             ImGui::SameLine();
             if (i + 1 == data->tracks) ImGui::BeginDisabled();
             if (ImGui::Button("v") && i + 1 < data->tracks) {
-                std::swap(data->data[i + 1], data->data[i]);
+                this->runOnUpdate([this, i] { swapTracks(i, i + 1); });
             }
             if (i + 1 == data->tracks) ImGui::EndDisabled();
             ImGui::SameLine();
@@ -449,7 +455,7 @@ void Editor::renderTrackEditor(std::shared_ptr<MidiFile>& data) {
                     this->trackEditorOpen = false;
                     this->showError("Cannot delete the last track in a file !");
                 } else
-                    this->removeTrack(i);
+                    this->runOnUpdate([this, i] { removeTrack(i); });
             }
         }
         ImGui::PopID();
@@ -459,7 +465,7 @@ void Editor::renderTrackEditor(std::shared_ptr<MidiFile>& data) {
     ImGui::EndPopup();
 }
 
-void Editor::renderFileParams(std::shared_ptr<MidiFile>& data) {
+void Editor::renderFileParams(const MidiFile* data) {
     if (!ImGui::Begin("File", NULL, 0) || !data) {
         ImGui::End();
         return;
@@ -473,36 +479,57 @@ void Editor::renderFileParams(std::shared_ptr<MidiFile>& data) {
         // ImGui::Popup
     }
 
-    data->format = std::clamp(item, 0, 2);
+    const u16 format = std::clamp(item, 0, 2);
+    if (format != data->format) {
+        this->runOnUpdate([this, format] {
+            std::shared_ptr<MidiFile> file = getData();
+            if (file) file->format = format;
+        });
+    }
 
     bool changed = false;
-    bool type = data->division >> 15;
+    u16 division = data->division;
+    bool type = division >> 15;
     ImGui::SetNextItemWidth(200);
     changed |= ImGui::Checkbox(
         "Type of time division (Ticks per quarter note/Frames per sec)", &type);
 
     if (type) {
-        int i = (-(i8)((data->division >> 8) & 0xFF)) & 0x7F,
-            j = data->division & 0xFF;
+        int i = (-(i8)((division >> 8) & 0xFF)) & 0x7F,
+            j = division & 0xFF;
         ImGui::SetNextItemWidth(100);
         changed |= ImGui::InputInt("Frames per second", &i, 1, 2);
         ImGui::SameLine();
         ImGui::SetNextItemWidth(100);
         changed |= ImGui::InputInt("Ticks per frame", &j, 1, 10);
-        data->division =
+        division =
             ((-(i8)std::clamp(i, 24, 30)) << 8) | (std::clamp(j, 1, 0xFF));
     } else {
-        int i = data->division & 0x7FFF;
+        int i = division & 0x7FFF;
         ImGui::SetNextItemWidth(200);
         changed |= ImGui::InputInt("Time division (TPQ)", &i, 1, 0x7FFF);
-        data->division = std::clamp(i, 1, 0x7FFF);
+        division = std::clamp(i, 1, 0x7FFF);
+    }
+    if (changed && division != data->division) {
+        this->runOnUpdate([this, division] {
+            std::shared_ptr<MidiFile> file = getData();
+            if (!file) return;
+            file->division = division;
+            this->tempoHasChanged = true;
+        });
     }
-    if (changed) {
-        data->timingInfo.clear();
 
-        for (u32 j = 0; j < data->tracks; j++) {
-            computeTimeMapsForTrack(*data, data->data[j]);
-        }
+    bool optionsChanged = ImGui::Checkbox("Running status when saving",
+                                          &this->writeOptions.runningStatus);
+    ImGui::BeginDisabled(!this->writeOptions.runningStatus);
+    optionsChanged |= ImGui::Checkbox(
+        "Save note offs as note ons (loses release velocity)",
+        &this->writeOptions.noteOffAsNoteOn);
+    ImGui::EndDisabled();
+    if (optionsChanged) {
+        this->runOnUpdate([this, options = this->writeOptions] {
+            this->saveOptions = options;
+        });
     }
 
     ImGui::SetNextItemWidth(200);
@@ -513,7 +540,7 @@ void Editor::renderFileParams(std::shared_ptr<MidiFile>& data) {
 }
 
 constexpr int WIDTH = 125;
-void Editor::renderParams(std::shared_ptr<MidiFile>& data) {
+void Editor::renderParams(const MidiFile* data) {
     if (!ImGui::Begin("Parameters", NULL, 0)) {
         ImGui::End();
         return;
@@ -523,16 +550,16 @@ void Editor::renderParams(std::shared_ptr<MidiFile>& data) {
     ImGui::InputInt("Table size", &i, 1, 100);
     this->eventTableSize = std::clamp((u64)i, (u64)0, (u64)2000);
     ImGui::PushItemWidth(WIDTH);
-    ImGui::InputInt("Offset", &j, 1, 100);
-    if (data && k != 0 && k <= data->tracks)
-        this->offset =
-            std::clamp((u64)j, (u64)0, data->data[k - 1].list.size());
-    else
-        this->offset = std::clamp((u64)j, (u64)0u, this->totalEvents);
+    // Jumps also move the table, so only update() writes the offset
+    if (ImGui::InputInt("Offset", &j, 1, 100)) {
+        const u64 row = std::max(j, 0);
+        this->runOnUpdate([this, row] { setOffset(row); });
+    }
     ImGui::PushItemWidth(WIDTH);
     ImGui::Checkbox("All tracks", &this->showAllTracks);
     ImGui::SameLine();
     ImGui::PushItemWidth(WIDTH);
+    const u32 shown = this->trackToShow;
     if (!data || this->showAllTracks) {
         this->trackToShow = 0;
         ImGui::BeginDisabled();
@@ -542,16 +569,44 @@ void Editor::renderParams(std::shared_ptr<MidiFile>& data) {
         ImGui::InputInt("Track", &k, 1, 5);
         this->trackToShow = std::clamp(k, 1, (int)data->tracks);
     }
+    // The offset may now be past the rows of the track shown
+    if (this->trackToShow != shown)
+        this->runOnUpdate([this] { setOffset(this->offset); });
+
+    ImGui::BeginDisabled(!data);
+    ImGui::PushItemWidth(WIDTH);
+    ImGui::InputDouble("Time (s)", &this->jumpSeconds, 1, 60, "%.3f");
+    this->jumpSeconds = std::max(this->jumpSeconds, 0.0);
+    ImGui::SameLine();
+    if (ImGui::Button("Jump##time") && data) {
+        const v_len tick =
+            getTickAtMicros(data->timingInfo, (u64)(this->jumpSeconds * 1e6));
+        this->runOnUpdate([this, tick] { jumpToTick(tick); });
+    }
+    ImGui::PushItemWidth(WIDTH);
+    ImGui::InputInt("Bar", &this->jumpBar, 1, 10);
+    this->jumpBar = std::max(this->jumpBar, 0);
+    ImGui::SameLine();
+    ImGui::PushItemWidth(WIDTH);
+    ImGui::InputDouble("Beat", &this->jumpBeat, 1, 1, "%.2f");
+    this->jumpBeat = std::max(this->jumpBeat, 0.0);
+    ImGui::SameLine();
+    if (ImGui::Button("Jump##bar") && data) {
+        const v_len tick = getTickAtBar(
+            data->timeSignatureInfo,
+            BarTime{.bar = (u32)this->jumpBar, .barTime = this->jumpBeat});
+        this->runOnUpdate([this, tick] { jumpToTick(tick); });
+    }
+    ImGui::EndDisabled();
     ImGui::End();
 }
 
-void Editor::renderTable(std::shared_ptr<MidiFile>& data) {
+void Editor::renderTable(const MidiFile* data) {
     if (!ImGui::Begin("Table", NULL, 0)) {
         ImGui::End();
         return;
     }
-    if (!data || data->tracks == 0 || !data->data[0].decoded ||
-        this->eventTableSize == 0) {
+    if (!data || data->tracks == 0 || this->eventTableSize == 0) {
         ImGui::Text("No data");
         ImGui::End();
         return;
@@ -579,31 +634,31 @@ void Editor::renderTable(std::shared_ptr<MidiFile>& data) {
     ImGui::TableHeadersRow();
     u64 remaining = this->eventTableSize;
     u32 o = offset;
-    const TempoChange defaultTempo =
-        TempoChange{.time = 0,
-                    .timeMicros = 0,
-                    .microsPerTick = getMicrosPerTick(data->division, 500000)};
+    this->tableTimes.resize(data->tracks);
     for (u32 j = 0; j < data->tracks; j++) {
         if (this->trackToShow != 0 && this->trackToShow != j + 1) continue;
-        MidiTrack& track = data->data[j];
-        if (!track.decoded) continue;
-        if (o >= track.list.size()) {
-            o -= track.list.size();
+        const MidiTrack& track = data->track(j);
+        if (o >= track.size()) {
+            o -= track.size();
+            continue;
+        }
+        // update() decodes it, it is shown by a later version, its rows are
+        // still counted so later tracks stay where they belong
+        if (!track.decoded) {
+            remaining -= std::min<u64>(remaining, track.size() - o);
+            o = 0;
+            if (remaining == 0) break;
             continue;
         }
+        // Only the visible rows, and only when they changed
+        updateTrackTimes(*data, track, this->tableTimes[j], o, remaining);
 
-        bool changeDT = false;
-        std::vector<TempoChange>::const_iterator t = data->timingInfo.cbegin();
         for (u32 i = o; i < track.list.size(); i++) {
             o = 0;
             ImGui::PushID(remaining);
-            TrackEvent& message = track.list[i];
+            const v_len time = track.list.time(i);
             ImGui::TableNextRow();
-            while (t + 1 < data->timingInfo.cend() &&
-                   (t + 1)->time <= message.time) {
-                t++;
-            }
-            if (message.type == META && message.meta->type == END_OF_TRACK) {
+            if (track.list.isMeta(i, END_OF_TRACK)) {
                 if (((this->eventTableSize - remaining) % 2) == 1) {
                     ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0,
                                            0x805555FF);
@@ -613,38 +668,34 @@ void Editor::renderTable(std::shared_ptr<MidiFile>& data) {
                 }
             }
             if (ImGui::TableNextColumn()) {
-                int v = message.deltaTime;
-                changeDT |= ImGui::InputInt("##deltatime", &v);
-                message.deltaTime = std::clamp(v, 0, 0xFFFFFF);
+                int v = track.list.deltaTime(i);
+                if (ImGui::InputInt("##deltatime", &v)) {
+                    const v_len delta = std::clamp(v, 0, 0xFFFFFF);
+                    this->runOnUpdate(
+                        [this, j, i, delta] { setDeltaTime(j, i, delta); });
+                }
             }
-            if (ImGui::TableNextColumn()) ImGui::Text("%u", message.time);
-            // TODO put those computations in update() if optimisation
-            // needed
+            if (ImGui::TableNextColumn()) ImGui::Text("%u", time);
             if (ImGui::TableNextColumn()) {
-                BarTime bar = getBar(data->timeSignatureInfo, message.time);
+                const BarTime& bar = this->tableTimes[j].barAt(i);
                 ImGui::Text("%u : %.4lf", bar.bar, bar.barTime);
             }
             if (ImGui::TableNextColumn()) {
-                const TempoChange& tempo =
-                    (t != data->timingInfo.cend()) ? *t : defaultTempo;
+                const u64 micros = this->tableTimes[j].microsAt(i);
                 // Stupid warning needs an explicit cast
                 if (sizeof(unsigned long long) == sizeof(u64))
-                    ImGui::Text("%llu", (unsigned long long)getTimeMicros(
-                                            tempo, message.time));
+                    ImGui::Text("%llu", (unsigned long long)micros);
                 else
-                    ImGui::Text("%lu", (unsigned long)getTimeMicros(
-                                           tempo, message.time));
+                    ImGui::Text("%lu", (unsigned long)micros);
             }
-            if (ImGui::TableNextColumn()) printTextForTrackEventType(message);
-            if (ImGui::TableNextColumn()) {
-                bool changed = printDataTextForTrackEvent(message);
-                if (changed && message.type == META &&
-                    message.meta->type == SET_TEMPO) {
-                    tempoHasChanged = true;
-                } else if (changed && message.type == META &&
-                           message.meta->type == TIME_SIGNATURE) {
-                    timeSignatureHasChanged = true;
-                }
+            if (ImGui::TableNextColumn())
+                printTextForTrackEventType(track.list, i);
+            TrackEvent edited;
+            if (ImGui::TableNextColumn() &&
+                printDataTextForEvent(track.list, i, edited)) {
+                this->runOnUpdate([this, j, i, edited = std::move(edited)] {
+                    setEvent(j, i, edited);
+                });
             }
 
             constexpr ImGuiSelectableFlags selectable_flags =
@@ -663,13 +714,9 @@ void Editor::renderTable(std::shared_ptr<MidiFile>& data) {
             if (--remaining == 0) break;
         }
         if (remaining == 0) break;
-        ImGui::PushID(j + this->totalEvents + 1);
+        ImGui::PushID(j + this->totalEvents.load() + 1);
         ImGui::TableHeadersRow();
         ImGui::PopID();
-
-        if (changeDT) {
-            computeTimes(track.list);
-        }
     }
 
     ImGui::PushID(1);
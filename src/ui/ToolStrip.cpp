@@ -17,7 +17,8 @@ ToolStrip::ToolStrip(Editor& editor, ResourceManager& resourceManager,
         file->data->decoded = true;
         file->data->data = NULL;
         file->data->length = 0;
-        file->data->list = std::vector<TrackEvent>();
+        file->data->list.clear();
+        file->data->list.setArena(&file->arena);
 
         TrackEvent endTrack;
         endTrack.deltaTime = 0;
@@ -27,7 +28,7 @@ ToolStrip::ToolStrip(Editor& editor, ResourceManager& resourceManager,
 
         file->data->list.push_back(endTrack);
 
-        computeTimeMapsForTrack(*file, file->data[0]);
+        computeTimeMaps(*file);
 
         this->editor.setData(file);
     });
@@ -0,0 +1,38 @@
+#include "Arena.hpp"
+
+#include <cstdint>
+
+Arena::Arena(std::size_t blockSize) : defaultSize(blockSize) {}
+
+u8* Arena::newBlock(std::size_t size) {
+    std::unique_ptr<u8[]> block(new u8[size]);
+    u8* res = block.get();
+    std::lock_guard<std::mutex> lock(mutex);
+    blocks.emplace_back(std::move(block));
+    allocated += size;
+    return res;
+}
+
+void Arena::release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    blocks.clear();
+    allocated = 0;
+}
+
+std::size_t Arena::bytesAllocated() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocated;
+}
+
+u8* ArenaAllocator::allocate(std::size_t size, std::size_t align) {
+    std::uintptr_t p = ((std::uintptr_t)cursor + align - 1) & ~(align - 1);
+    if (cursor == nullptr || p + size > (std::uintptr_t)limit) {
+        // Big allocations get a block of their own and keep the current one
+        if (size > arena->blockSize() / 4) return arena->newBlock(size);
+        cursor = arena->newBlock(arena->blockSize());
+        limit = cursor + arena->blockSize();
+        p = (std::uintptr_t)cursor;
+    }
+    cursor = (u8*)(p + size);
+    return (u8*)p;
+}
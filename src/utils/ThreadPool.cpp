@@ -0,0 +1,91 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(unsigned threads) {
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+void ThreadPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.emplace_back(std::move(job));
+    }
+    available.notify_one();
+}
+
+void ThreadPool::work() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            available.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+namespace {
+struct ParallelForState {
+    std::function<void(std::size_t)> fn;
+    std::size_t n;
+    std::atomic<std::size_t> next{0};
+    std::size_t done = 0;
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    // Claims indices until none are left
+    void run() {
+        std::size_t count = 0;
+        for (std::size_t i = next++; i < n; i = next++) {
+            fn(i);
+            count++;
+        }
+        if (count == 0) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        done += count;
+        if (done == n) finished.notify_all();
+    }
+};
+}  // namespace
+
+void ThreadPool::parallelFor(std::size_t n,
+                             const std::function<void(std::size_t)>& fn) {
+    if (n == 0) return;
+    if (n == 1) {
+        fn(0);
+        return;
+    }
+    // Shared so that workers picking up a job late never see a dead state
+    std::shared_ptr<ParallelForState> state =
+        std::make_shared<ParallelForState>();
+    state->fn = fn;
+    state->n = n;
+
+    std::size_t helpers = std::min(n - 1, workers.size());
+    for (std::size_t i = 0; i < helpers; i++) {
+        submit([state]() { state->run(); });
+    }
+    state->run();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&state]() { return state->done == state->n; });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    available.notify_all();
+    for (std::thread& t : workers) t.join();
+}
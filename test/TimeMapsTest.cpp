@@ -0,0 +1,64 @@
+// Checks that converting bars and beats back to ticks agrees with getBar,
+// including bars holding several time signature changes
+// Build and run with `make test`
+
+#include <iostream>
+#include <vector>
+
+#include "MidiFile.hpp"
+
+static int failures = 0;
+
+static void expectTick(const std::vector<TimeSignatureChange>& map,
+                       const BarTime& bar, v_len expected) {
+    const v_len tick = getTickAtBar(map, bar);
+    if (tick == expected) return;
+    failures++;
+    std::cerr << "bar " << bar.bar << " beat " << bar.barTime << ": got tick "
+              << tick << ", expected " << expected << "\n";
+}
+
+static TimeSignatureChange change(v_len time, u32 bar, u8 numerator,
+                                  u8 denominator) {
+    return TimeSignatureChange{
+        .time = time,
+        .bar = bar,
+        .signature = TimeSignature{.numerator = numerator,
+                                   .denominator = denominator,
+                                   .TPM = 24,
+                                   .noteDivision = 8}};
+}
+
+// The earliest tick of each position must map back to it
+static void checkRoundTrip(const std::vector<TimeSignatureChange>& map,
+                           v_len end) {
+    for (v_len tick = 0; tick < end; tick++) {
+        const BarTime bar = getBar(map, tick);
+        const v_len back = getTickAtBar(map, bar);
+        if (back > tick || getBar(map, back).bar != bar.bar) {
+            failures++;
+            std::cerr << "tick " << tick << " at bar " << bar.bar << " beat "
+                      << bar.barTime << " maps back to " << back << "\n";
+        }
+    }
+}
+
+int main() {
+    // 4/4, then 2/4 and 4/8 both starting in bar 1
+    const std::vector<TimeSignatureChange> twoInOneBar = {
+        change(0, 0, 4, 2), change(667, 1, 2, 2), change(811, 1, 4, 3)};
+    expectTick(twoInOneBar, {.bar = 1, .barTime = 2.052}, 581);
+    expectTick(twoInOneBar, {.bar = 1, .barTime = 0}, 384);
+    expectTick(twoInOneBar, {.bar = 0, .barTime = 1}, 96);
+    // Only reached from the last change of the bar
+    expectTick(twoInOneBar, {.bar = 2, .barTime = 0}, 1003);
+    checkRoundTrip(twoInOneBar, 3000);
+
+    const std::vector<TimeSignatureChange> threeInOneBar = {
+        change(0, 0, 3, 2), change(300, 1, 5, 3), change(340, 1, 7, 3),
+        change(400, 1, 2, 1)};
+    checkRoundTrip(threeInOneBar, 3000);
+
+    if (failures == 0) std::cout << "All time map checks passed\n";
+    return failures == 0 ? 0 : 1;
+}